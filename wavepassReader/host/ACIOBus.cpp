@@ -0,0 +1,134 @@
+#include "ACIOBus.h"
+#include <string.h>
+
+ACIOBus::ACIOBus()
+{
+    powered = true;
+    baudrate = ACIO_DEFAULT_BAUDRATE;
+    memset(&stats, 0, sizeof(stats));
+    reset_wire();
+}
+
+void ACIOBus::reset_wire()
+{
+    decoder.reset();
+    decoder.begin(&request);
+    output.clear();
+    line_free_us = 0;
+}
+
+uint32_t ACIOBus::max_baudrate() const
+{
+    return 0xFFFFFFFF;
+}
+
+void ACIOBus::set_baudrate(uint32_t rate)
+{
+    baudrate = rate;
+}
+
+uint32_t ACIOBus::byte_time_us() const
+{
+    /* 8N1, 10 bits per byte */
+    return (10 * 1000000 + baudrate - 1) / baudrate;
+}
+
+void ACIOBus::queue_output(uint8_t value, uint64_t time)
+{
+    if (time < line_free_us) {
+        time = line_free_us;
+    }
+    time += byte_time_us();
+    line_free_us = time;
+    output.push_back({time, value});
+    stats.bytes_tx++;
+}
+
+static bool acio_bus_sink(const uint8_t *data, int length, void *ctx)
+{
+    std::deque<uint8_t> *bytes = (std::deque<uint8_t> *)ctx;
+    bytes->insert(bytes->end(), data, data + length);
+    return true;
+}
+
+void ACIOBus::respond(const uint8_t *payload, int length, uint64_t now, uint32_t latency_us,
+                      bool corrupt)
+{
+    struct ac_io_message resp;
+    std::deque<uint8_t> bytes;
+
+    resp.addr = request.addr | 0x80;
+    resp.cmd.code = request.cmd.code;
+    resp.cmd.seq_no = request.cmd.seq_no;
+    resp.cmd.nbytes = length;
+    memcpy(resp.cmd.raw, payload, length);
+
+    acio_frame_encode((const uint8_t *)&resp, offsetof(struct ac_io_message, cmd.raw) + length,
+                      acio_bus_sink, &bytes);
+
+    /* the checksum is the last byte on the wire, escaped or not. Flip a
+       bit that doesn't turn it into a SOF or an escape. */
+    if (corrupt) {
+        uint8_t bad = bytes.back() ^ 0x01;
+        if (bad == AC_IO_SOF || bad == AC_IO_ESCAPE) {
+            bad = bytes.back() ^ 0x02;
+        }
+        bytes.back() = bad;
+    }
+
+    uint64_t start = now + latency_us;
+    for (uint8_t value : bytes) {
+        queue_output(value, start);
+    }
+    stats.frames_tx++;
+}
+
+void ACIOBus::receive(uint8_t value, uint64_t now)
+{
+    if (!powered) {
+        return;
+    }
+
+    stats.bytes_rx++;
+    /* devices can't follow a faster line, they see noise */
+    if (baudrate > max_baudrate()) {
+        value = (value << 1) | 1;
+        stats.garbled_bytes++;
+    }
+
+    /* a SOF between frames is echoed, the host uses it to sync */
+    if (value == AC_IO_SOF && (!decoder.in_frame() || decoder.frame_size() == 0)) {
+        queue_output(AC_IO_SOF, now);
+    }
+
+    int consumed;
+    acio_decode_status status = decoder.push(&value, 1, &consumed);
+    if (status == ACIO_DECODE_FRAME) {
+        stats.frames_rx++;
+        handle_frame(now);
+    }
+    if (status != ACIO_DECODE_PENDING) {
+        /* keeps the SOF a framing error resynced on */
+        decoder.begin(&request);
+    }
+}
+
+bool ACIOBus::has_output() const
+{
+    return !output.empty();
+}
+
+uint64_t ACIOBus::next_output_time() const
+{
+    return output.empty() ? 0 : output.front().time;
+}
+
+int ACIOBus::transmit(uint8_t *buffer, int size, uint64_t now)
+{
+    int n = 0;
+    while (n < size && !output.empty() && output.front().time <= now) {
+        buffer[n++] = output.front().value;
+        output.pop_front();
+    }
+    return n;
+}
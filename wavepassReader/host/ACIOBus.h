@@ -0,0 +1,69 @@
+#ifndef acio_bus_h
+#define acio_bus_h
+
+#include <stdint.h>
+#include <deque>
+#include "ACIO.h"
+#include "ACIOFrame.h"
+
+/* Device side of the ACIO wire for host builds.
+   Decodes the requests the host HAL delivers byte by byte, echoes SOFs
+   between frames and schedules response bytes with the timing of the
+   current baudrate. What a request is answered with is up to the
+   subclass (the reader simulator, the trace replay). */
+
+struct acio_bus_stats {
+    uint32_t frames_rx;
+    uint32_t frames_tx;
+    uint32_t bytes_rx;
+    uint32_t bytes_tx;
+    uint32_t garbled_bytes; /* received at a rate the bus doesn't follow */
+};
+
+class ACIOBus
+{
+public:
+    ACIOBus();
+    virtual ~ACIOBus() {}
+
+    /* wire side, driven by the host HAL */
+    void set_baudrate(uint32_t baudrate);
+    void receive(uint8_t value, uint64_t now);
+    bool has_output() const;
+    uint64_t next_output_time() const;
+    int transmit(uint8_t *buffer, int size, uint64_t now);
+
+    struct acio_bus_stats stats;
+
+protected:
+    /* request holds a complete frame received at now */
+    virtual void handle_frame(uint64_t now) = 0;
+    /* fastest rate every device on the bus follows */
+    virtual uint32_t max_baudrate() const;
+
+    /* answer request with payload, first byte leaves after latency_us,
+       corrupt sends a wrong checksum */
+    void respond(const uint8_t *payload, int length, uint64_t now, uint32_t latency_us,
+                 bool corrupt = false);
+    /* drop anything in flight, in both directions */
+    void reset_wire();
+    uint32_t byte_time_us() const;
+
+    struct ac_io_message request;
+    bool powered;
+    uint32_t baudrate;
+
+private:
+    struct output_byte {
+        uint64_t time;
+        uint8_t value;
+    };
+
+    void queue_output(uint8_t value, uint64_t time);
+
+    ACIODecoder decoder;
+    std::deque<output_byte> output;
+    uint64_t line_free_us;
+};
+
+#endif
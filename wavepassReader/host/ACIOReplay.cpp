@@ -0,0 +1,268 @@
+#include "ACIOReplay.h"
+#include <string.h>
+
+/* how far ahead to look for the answer to a request */
+#define ACIO_REPLAY_MATCH_WINDOW 32
+#define ACIO_REPLAY_SYNTH_LATENCY_US 1000
+
+/* reader key handed out when the trace has no key exchange */
+static const uint8_t acio_replay_reader_key[4] = {0x5c, 0x71, 0x0e, 0xa3};
+
+static const uint8_t acio_replay_blank_uid[8] = {0};
+
+static uint32_t acio_replay_key(const uint8_t *key)
+{
+    return (uint32_t)key[0] << 24 | (uint32_t)key[1] << 16 | (uint32_t)key[2] << 8 | key[3];
+}
+
+static uint16_t acio_replay_code(const std::vector<uint8_t> &bytes)
+{
+    return bytes[1] << 8 | bytes[2];
+}
+
+ACIOReplay::ACIOReplay()
+{
+    memset(&replay_stats, 0, sizeof(replay_stats));
+    memset(encrypted, 0, sizeof(encrypted));
+    memset(live_keyed, 0, sizeof(live_keyed));
+    memset(last_uid, 0, sizeof(last_uid));
+    memset(served_us, 0, sizeof(served_us));
+    nodes = 0;
+    duration = 0;
+}
+
+/* remember when each card first showed up in a poll answer */
+void ACIOReplay::track_card(const struct acio_replay_exchange &ex)
+{
+    if (ex.corrupt || ex.payload.size() < sizeof(iccx_state_t)) {
+        return;
+    }
+    if (ex.code != AC_IO_CMD_ICCx_POLL && ex.code != AC_IO_CMD_ICCx_FEL_POLL &&
+        ex.code != AC_IO_CMD_ICCx_ENGAGE) {
+        return;
+    }
+
+    const uint8_t *state = ex.payload.data();
+    if (ex.decrypted) {
+        uint16_t crc = state[16] << 8 | state[17];
+        if (crc != Cipher::CRCCCITT((unsigned char *)state, 16)) {
+            return;
+        }
+    }
+
+    /* byte 0 is sensor_state on ICCB/C and status_code on ICCA, both
+       report a card the same way, the UID sits at the same offset */
+    const uint8_t *uid = ((const iccx_state_t *)state)->uid;
+    bool card = state[0] == AC_IO_ICCx_SENSOR_CARD && memcmp(uid, acio_replay_blank_uid, 8) != 0;
+
+    if (!card) {
+        memset(last_uid[ex.addr], 0, 8);
+        return;
+    }
+    if (memcmp(uid, last_uid[ex.addr], 8) == 0) {
+        return;
+    }
+
+    struct acio_replay_card seen;
+    seen.time_us = ex.time_us;
+    seen.node_id = ex.addr - 1;
+    memcpy(seen.uid, uid, 8);
+    card_list.push_back(seen);
+    memcpy(last_uid[ex.addr], uid, 8);
+}
+
+bool ACIOReplay::load(const std::vector<capture_trace_frame> &frames)
+{
+    for (size_t i = 0; i < frames.size(); i++) {
+        const capture_trace_frame &tx = frames[i];
+        if (tx.rx || tx.bytes.size() < offsetof(struct ac_io_message, cmd.raw) ||
+            tx.bytes[0] >= ACIO_REPLAY_MAX_ADDRS) {
+            continue;
+        }
+
+        struct acio_replay_exchange ex;
+        ex.time_us = tx.time_us;
+        ex.addr = tx.bytes[0];
+        ex.code = acio_replay_code(tx.bytes);
+        ex.answered = false;
+        ex.corrupt = false;
+        ex.decrypted = false;
+        ex.latency_us = 0;
+
+        /* the answer carries the same seq_no and code, a resend of the
+           request before it means this attempt went unanswered */
+        for (size_t j = i + 1; j < frames.size() && j <= i + ACIO_REPLAY_MATCH_WINDOW; j++) {
+            const capture_trace_frame &rx = frames[j];
+            if (rx.bytes.size() < offsetof(struct ac_io_message, cmd.raw) ||
+                rx.bytes[3] != tx.bytes[3] || acio_replay_code(rx.bytes) != ex.code) {
+                continue;
+            }
+            if (!rx.rx) {
+                break;
+            }
+            ex.answered = true;
+            ex.corrupt = rx.status == CAPTURE_CHECKSUM_ERROR;
+            ex.latency_us = rx.time_us - tx.time_us;
+            ex.payload.assign(rx.bytes.begin() + offsetof(struct ac_io_message, cmd.raw), rx.bytes.end());
+
+            /* an encrypted answer is followed by its plaintext */
+            for (size_t k = j + 1; k < frames.size() && k <= j + 4; k++) {
+                const std::vector<uint8_t> &plain = frames[k].bytes;
+                if (frames[k].status == CAPTURE_DECRYPTED && plain.size() == rx.bytes.size() &&
+                    plain[3] == rx.bytes[3] && acio_replay_code(plain) == ex.code) {
+                    ex.payload.assign(plain.begin() + offsetof(struct ac_io_message, cmd.raw), plain.end());
+                    ex.decrypted = true;
+                    break;
+                }
+            }
+            break;
+        }
+
+        if (ex.code == AC_IO_CMD_ICCx_FEL_POLL) {
+            encrypted[ex.addr] = true;
+        }
+        if (ex.addr > nodes) {
+            nodes = ex.addr;
+        }
+        if (tx.time_us > duration) {
+            duration = tx.time_us;
+        }
+
+        track_card(ex);
+        lanes[(uint32_t)ex.addr << 16 | ex.code].push_back(exchanges.size());
+        exchanges.push_back(ex);
+    }
+
+    return !exchanges.empty();
+}
+
+uint8_t ACIOReplay::node_count() const
+{
+    return nodes;
+}
+
+bool ACIOReplay::node_encrypted(uint8_t node_id) const
+{
+    return node_id + 1 < ACIO_REPLAY_MAX_ADDRS && encrypted[node_id + 1];
+}
+
+uint64_t ACIOReplay::duration_us() const
+{
+    return duration;
+}
+
+const std::vector<acio_replay_card> &ACIOReplay::cards() const
+{
+    return card_list;
+}
+
+uint64_t ACIOReplay::trace_time_us(uint8_t node_id) const
+{
+    return node_id + 1 < ACIO_REPLAY_MAX_ADDRS ? served_us[node_id + 1] : 0;
+}
+
+/* the captured exchange current at now: the last one sent by then, or
+   the next one if the stack got there first */
+int ACIOReplay::pick(uint8_t addr, uint16_t code, uint64_t now)
+{
+    uint32_t key = (uint32_t)addr << 16 | code;
+    auto lane = lanes.find(key);
+    if (lane == lanes.end()) {
+        return -1;
+    }
+
+    const std::vector<size_t> &list = lane->second;
+    size_t &cursor = cursors[key];
+    if (cursor >= list.size()) {
+        /* ran past the end of the trace, keep answering with the last one */
+        return list.back();
+    }
+
+    size_t best = cursor;
+    while (best + 1 < list.size() && exchanges[list[best + 1]].time_us <= now) {
+        best++;
+    }
+    replay_stats.skipped += best - cursor;
+    cursor = best + 1;
+    return list[best];
+}
+
+/* answers for the bring-up commands, in case the capture started later */
+bool ACIOReplay::synthesize(uint8_t addr, uint16_t code, uint64_t now)
+{
+    uint8_t status = 0;
+
+    switch (code) {
+    case AC_IO_CMD_ASSIGN_ADDRS:
+        respond(&nodes, 1, now, ACIO_REPLAY_SYNTH_LATENCY_US);
+        break;
+    case AC_IO_CMD_GET_VERSION: {
+        struct ac_io_version version;
+        memset(&version, 0, sizeof(version));
+        memcpy(version.product_code, encrypted[addr] ? "ICCB" : "ICCA", 4);
+        respond((const uint8_t *)&version, sizeof(version), now, ACIO_REPLAY_SYNTH_LATENCY_US);
+        break;
+    }
+    case AC_IO_CMD_START_UP:
+    case AC_IO_CMD_ICCx_QUEUE_LOOP_START:
+    case AC_IO_CMD_ICCx_BEGIN_KEYPAD:
+        respond(&status, 1, now, ACIO_REPLAY_SYNTH_LATENCY_US);
+        break;
+    case AC_IO_CMD_ICCx_KEY_EXCHANGE:
+        live_crypto[addr].setKeys(acio_replay_key(request.cmd.raw), acio_replay_key(acio_replay_reader_key));
+        live_keyed[addr] = true;
+        respond(acio_replay_reader_key, 4, now, ACIO_REPLAY_SYNTH_LATENCY_US);
+        break;
+    default:
+        return false;
+    }
+
+    replay_stats.synthesized++;
+    return true;
+}
+
+void ACIOReplay::handle_frame(uint64_t now)
+{
+    uint8_t addr = request.addr;
+    uint16_t code = ac_io_u16(request.cmd.code);
+
+    if (addr >= ACIO_REPLAY_MAX_ADDRS) {
+        replay_stats.unanswered++;
+        return;
+    }
+
+    int index = pick(addr, code, now);
+    if (index < 0) {
+        if (!synthesize(addr, code, now)) {
+            replay_stats.unanswered++;
+        }
+        return;
+    }
+    if (!exchanges[index].answered) {
+        replay_stats.unanswered++;
+        return;
+    }
+
+    const struct acio_replay_exchange &ex = exchanges[index];
+    uint8_t payload[0xFF];
+    served_us[addr] = ex.time_us;
+    int length = ex.payload.size();
+    memcpy(payload, ex.payload.data(), length);
+
+    if (code == AC_IO_CMD_ICCx_KEY_EXCHANGE && length >= 4) {
+        live_crypto[addr].setKeys(acio_replay_key(request.cmd.raw), acio_replay_key(payload));
+        live_keyed[addr] = true;
+    }
+    if (ex.decrypted && live_keyed[addr]) {
+        live_crypto[addr].crypt(payload, length);
+    }
+
+    /* the capture timed request sent to answer decoded, take off the
+       time both frames spend on the wire here */
+    uint32_t wire_us = (request.cmd.nbytes + length + 2 * (offsetof(struct ac_io_message, cmd.raw) + 2)) *
+                       byte_time_us();
+    uint32_t latency = ex.latency_us > wire_us ? ex.latency_us - wire_us : 0;
+
+    respond(payload, length, now, latency, ex.corrupt);
+    replay_stats.answered++;
+}
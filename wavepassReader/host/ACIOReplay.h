@@ -0,0 +1,93 @@
+#ifndef acio_replay_h
+#define acio_replay_h
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include "ACIOBus.h"
+#include "CaptureTrace.h"
+#include "Cipher.h"
+#include "ICCx.h"
+
+/* Plays the reader side of a captured ACIO session back to the stack.
+
+   Every request the stack sends is answered with the captured answer to
+   the same command on the same node that was current at that point of
+   the trace (the last one sent before, or the next one if the stack is
+   ahead), with the captured latency. A request the trace never answered
+   gets no answer at all, a corrupt answer is replayed corrupt.
+
+   Encrypted polls are replayed from the plaintext the firmware logged
+   next to them and encrypted for the live session, so the stack can poll
+   at a different rate than the original firmware did. A capture usually
+   starts after bring-up, the answers missing for that are made up. */
+
+/* bus addresses, 0 is the broadcast */
+#define ACIO_REPLAY_MAX_ADDRS (ICCX_MAX_NODES + 1)
+
+struct acio_replay_exchange {
+    uint64_t time_us; /* request sent, trace time */
+    uint8_t addr;
+    uint16_t code;
+    bool answered;
+    bool corrupt;   /* the answer failed its checksum */
+    bool decrypted; /* payload is the plaintext of an encrypted poll */
+    uint32_t latency_us; /* request sent to answer decoded */
+    std::vector<uint8_t> payload;
+};
+
+/* a card showing up in the captured answers */
+struct acio_replay_card {
+    uint64_t time_us;
+    uint8_t node_id; /* like the ICCx API, bus address - 1 */
+    uint8_t uid[8];
+};
+
+struct acio_replay_stats {
+    uint32_t answered;
+    uint32_t unanswered; /* no captured answer for the request */
+    uint32_t skipped;    /* captured exchanges the stack never asked for */
+    uint32_t synthesized; /* bring-up answers missing from the trace */
+};
+
+class ACIOReplay : public ACIOBus
+{
+public:
+    ACIOReplay();
+
+    bool load(const std::vector<capture_trace_frame> &frames);
+    uint8_t node_count() const;
+    bool node_encrypted(uint8_t node_id) const;
+    uint64_t duration_us() const;
+    const std::vector<acio_replay_card> &cards() const;
+    /* trace time of the last captured answer given to the node, the stack
+       may be ahead of or behind the trace on its own clock */
+    uint64_t trace_time_us(uint8_t node_id) const;
+
+    struct acio_replay_stats replay_stats;
+
+protected:
+    void handle_frame(uint64_t now);
+
+private:
+    void track_card(const struct acio_replay_exchange &ex);
+    int pick(uint8_t addr, uint16_t code, uint64_t now);
+    bool synthesize(uint8_t addr, uint16_t code, uint64_t now);
+
+    std::vector<acio_replay_exchange> exchanges;
+    /* exchange indexes per addr << 16 | code, in trace order */
+    std::map<uint32_t, std::vector<size_t>> lanes;
+    std::map<uint32_t, size_t> cursors;
+    std::vector<acio_replay_card> card_list;
+
+    bool encrypted[ACIO_REPLAY_MAX_ADDRS];
+    /* keystream of the live session */
+    Cipher live_crypto[ACIO_REPLAY_MAX_ADDRS];
+    bool live_keyed[ACIO_REPLAY_MAX_ADDRS];
+    uint8_t last_uid[ACIO_REPLAY_MAX_ADDRS][8];
+    uint64_t served_us[ACIO_REPLAY_MAX_ADDRS];
+    uint8_t nodes;
+    uint64_t duration;
+};
+
+#endif
@@ -0,0 +1,351 @@
+#include "ACIOSim.h"
+#include "ICCx.h"
+#include <string.h>
+
+#define ACIO_SIM_DEFAULT_LATENCY_US 1000
+
+/* what each reader model reports and tolerates */
+struct acio_sim_profile {
+    const char *product;
+    uint32_t max_baudrate;
+    uint32_t min_engage_gap_us;
+};
+
+static const struct acio_sim_profile acio_sim_profiles[] = {
+    /* indexed by acio_sim_model */
+    {"ICCA", 57600, 0},
+    {"ICCB", 115200, 40000},
+    {"ICCC", 115200, 15000},
+};
+
+static const uint8_t acio_sim_dev_key[4] = {0x5c, 0x71, 0x0e, 0xa3};
+
+ACIOSim::ACIOSim()
+{
+    reset();
+}
+
+void ACIOSim::reset()
+{
+    count = 0;
+    powered = true;
+    memset(&stats, 0, sizeof(stats));
+    reset_wire();
+}
+
+static void acio_sim_power_on(struct acio_sim_node *n)
+{
+    n->addressed = false;
+    n->started = false;
+    n->keyed = false;
+    n->slot_state = AC_IO_ICCA_SLOT_STATE_CLOSE;
+    n->ejected_event = false;
+    n->uid_read = false;
+    n->key_events[0] = 0;
+    n->key_events[1] = 0;
+    n->key_seq = 0;
+    n->engaged_us = 0;
+}
+
+int ACIOSim::add_node(enum acio_sim_model model)
+{
+    if (count == ACIO_SIM_MAX_NODES) {
+        return -1;
+    }
+
+    struct acio_sim_node *n = &nodes[count];
+    const struct acio_sim_profile *profile = &acio_sim_profiles[model];
+
+    memset(n, 0, sizeof(*n));
+    n->model = model;
+    memcpy(n->product, profile->product, 4);
+    n->max_baudrate = profile->max_baudrate;
+    n->latency_us = ACIO_SIM_DEFAULT_LATENCY_US;
+    n->min_engage_gap_us = profile->min_engage_gap_us;
+    memcpy(n->dev_key, acio_sim_dev_key, 4);
+    n->dev_key[3] += count;
+    acio_sim_power_on(n);
+
+    return count++;
+}
+
+struct acio_sim_node *ACIOSim::node(int index)
+{
+    if (index < 0 || index >= count) {
+        return NULL;
+    }
+    return &nodes[index];
+}
+
+int ACIOSim::node_count() const
+{
+    return count;
+}
+
+void ACIOSim::set_powered(bool on)
+{
+    if (on && !powered) {
+        for (int i = 0; i < count; i++) {
+            acio_sim_power_on(&nodes[i]);
+        }
+    }
+    powered = on;
+    reset_wire();
+}
+
+void ACIOSim::place_card(int index, const uint8_t uid[8], uint8_t card_type)
+{
+    struct acio_sim_node *n = node(index);
+    if (n == NULL) {
+        return;
+    }
+
+    memcpy(n->uid, uid, 8);
+    n->card_type = card_type;
+    n->uid_read = false;
+    /* the shutter stops a card halfway until the slot is opened */
+    if (n->model == ACIO_SIM_ICCA && n->slot_state != AC_IO_ICCA_SLOT_STATE_OPEN) {
+        n->card_pos = ACIO_SIM_CARD_FRONT;
+    } else {
+        n->card_pos = ACIO_SIM_CARD_INSERTED;
+    }
+}
+
+void ACIOSim::remove_card(int index)
+{
+    struct acio_sim_node *n = node(index);
+    if (n == NULL) {
+        return;
+    }
+
+    /* a locked card can't be pulled out */
+    if (n->model == ACIO_SIM_ICCA && n->card_pos == ACIO_SIM_CARD_INSERTED &&
+        n->slot_state != AC_IO_ICCA_SLOT_STATE_OPEN) {
+        return;
+    }
+    n->card_pos = ACIO_SIM_CARD_NONE;
+    n->uid_read = false;
+}
+
+void ACIOSim::set_keys(int index, uint16_t key_state)
+{
+    struct acio_sim_node *n = node(index);
+    if (n == NULL) {
+        return;
+    }
+
+    uint16_t pressed = key_state & ~n->key_state;
+    for (int bit = 0; bit < 16; bit++) {
+        if (!(pressed & (1 << bit))) {
+            continue;
+        }
+        /* keys are numbered 1..C column by column from the bottom left,
+           which puts bit 8 (key 0) first and the right column last */
+        uint8_t number = ((bit - 8) & 0xF) + 1;
+        n->key_events[1] = n->key_events[0];
+        n->key_events[0] = (n->key_seq << 4) | number;
+        n->key_seq = (n->key_seq + 1) & 0xF;
+    }
+    n->key_state = key_state;
+}
+
+void ACIOSim::desync_keystream(int index, int bytes)
+{
+    struct acio_sim_node *n = node(index);
+    if (n == NULL) {
+        return;
+    }
+
+    uint8_t scratch[32] = {0};
+    while (bytes > 0) {
+        int chunk = bytes < (int)sizeof(scratch) ? bytes : (int)sizeof(scratch);
+        n->crypto.crypt(scratch, chunk);
+        bytes -= chunk;
+    }
+}
+
+uint32_t ACIOSim::max_baudrate() const
+{
+    uint32_t max = 0xFFFFFFFF;
+    for (int i = 0; i < count; i++) {
+        if (nodes[i].max_baudrate < max) {
+            max = nodes[i].max_baudrate;
+        }
+    }
+    return max;
+}
+
+void ACIOSim::build_state(const struct acio_sim_node *n, uint8_t state[16]) const
+{
+    bool present = n->card_pos != ACIO_SIM_CARD_NONE;
+
+    memset(state, 0, 16);
+    if (n->model == ACIO_SIM_ICCA) {
+        icca_state_t *s = (icca_state_t *)state;
+        bool inserted = n->card_pos == ACIO_SIM_CARD_INSERTED;
+        /* only a fully inserted ISO15693 card can be read */
+        bool valid = inserted && n->card_type == AC_IO_ICCx_CARD_TYPE_ISO15696;
+
+        s->status_code = valid ? AC_IO_ICCA_SENSOR_CARD : AC_IO_ICCA_SENSOR_NO_CARD;
+        if (n->ejected_event) {
+            s->sensor_state = AC_IO_ICCA_SENSOR_STATE_CARD_EJECTED;
+        } else {
+            if (present) {
+                s->sensor_state |= AC_IO_ICCA_SENSOR_MASK_FRONT_ON;
+            }
+            if (inserted) {
+                s->sensor_state |= AC_IO_ICCA_SENSOR_MASK_BACK_ON;
+            }
+        }
+        if (valid) {
+            memcpy(s->uid, n->uid, 8);
+            s->card_type = n->card_type;
+        }
+        s->keypad_started = 1;
+        s->key_events[0] = n->key_events[0];
+        s->key_events[1] = n->key_events[1];
+        s->key_state = n->key_state;
+    } else {
+        iccx_state_t *s = (iccx_state_t *)state;
+
+        /* the sensor sees the card right away, the UID needs an ENGAGE */
+        s->sensor_state = present ? AC_IO_ICCx_SENSOR_CARD : AC_IO_ICCx_SENSOR_NO_CARD;
+        if (present && n->uid_read) {
+            s->card_type = n->card_type;
+            memcpy(s->uid, n->uid, 8);
+        }
+        s->keypad_started = 1;
+        s->key_events[0] = n->key_events[0];
+        s->key_events[1] = n->key_events[1];
+        s->key_state = n->key_state;
+    }
+}
+
+void ACIOSim::apply_slot_state(struct acio_sim_node *n, uint8_t slot_state)
+{
+    n->slot_commands++;
+    n->ejected_event = false;
+
+    switch (slot_state) {
+    case AC_IO_ICCA_SLOT_STATE_OPEN:
+        /* a card waiting at the shutter slides in */
+        if (n->card_pos == ACIO_SIM_CARD_FRONT) {
+            n->card_pos = ACIO_SIM_CARD_INSERTED;
+        }
+        break;
+    case AC_IO_ICCA_SLOT_STATE_EJECT:
+        if (n->card_pos == ACIO_SIM_CARD_INSERTED) {
+            n->card_pos = ACIO_SIM_CARD_FRONT;
+            n->ejected_event = true;
+            n->ejects++;
+        }
+        break;
+    default:
+        break;
+    }
+    n->slot_state = slot_state;
+}
+
+void ACIOSim::handle_node_command(struct acio_sim_node *n, uint64_t now)
+{
+    uint16_t code = ac_io_u16(request.cmd.code);
+    uint8_t payload[0xFF];
+    uint8_t status = 0;
+
+    n->commands++;
+
+    switch (code) {
+    case AC_IO_CMD_GET_VERSION: {
+        struct ac_io_version version;
+        memset(&version, 0, sizeof(version));
+        version.type = 3;
+        version.major = 1;
+        version.minor = 6;
+        memcpy(version.product_code, n->product, 4);
+        memcpy(version.date, "Apr 19 2011", 11);
+        memcpy(version.time, "16:41:00", 8);
+        respond((const uint8_t *)&version, sizeof(version), now, n->latency_us);
+        return;
+    }
+    case AC_IO_CMD_START_UP:
+        n->started = true;
+        respond(&status, 1, now, n->latency_us);
+        return;
+    case AC_IO_CMD_ICCx_QUEUE_LOOP_START:
+    case AC_IO_CMD_ICCx_BEGIN_KEYPAD:
+        respond(&status, 1, now, n->latency_us);
+        return;
+    case AC_IO_CMD_ICCx_KEY_EXCHANGE: {
+        const uint8_t *key = request.cmd.raw;
+        unsigned long client_key = ((unsigned long)key[0]) << 24 | ((unsigned long)key[1]) << 16 |
+                                   ((unsigned long)key[2]) << 8 | (unsigned long)key[3];
+        unsigned long reader_key = ((unsigned long)n->dev_key[0]) << 24 |
+                                   ((unsigned long)n->dev_key[1]) << 16 |
+                                   ((unsigned long)n->dev_key[2]) << 8 | (unsigned long)n->dev_key[3];
+        n->crypto.setKeys(client_key, reader_key);
+        n->keyed = true;
+        respond(n->dev_key, 4, now, n->latency_us);
+        return;
+    }
+    case AC_IO_CMD_ICCx_ENGAGE:
+    case AC_IO_CMD_ICCx_FEL_ENGAGE:
+        if (n->card_pos != ACIO_SIM_CARD_NONE) {
+            n->uid_read = true;
+        }
+        n->engaged_us = now;
+        build_state(n, payload);
+        respond(payload, 16, now, n->latency_us);
+        return;
+    case AC_IO_CMD_ICCx_POLL:
+        build_state(n, payload);
+        respond(payload, 16, now, n->latency_us);
+        return;
+    case AC_IO_CMD_ICCx_FEL_POLL: {
+        /* polled while still busy with the ENGAGE, no answer */
+        if (now - n->engaged_us < n->min_engage_gap_us) {
+            n->early_polls++;
+            return;
+        }
+        build_state(n, payload);
+        uint16_t crc = Cipher::CRCCCITT(payload, 16);
+        payload[16] = crc >> 8;
+        payload[17] = crc & 0xFF;
+        if (n->keyed) {
+            n->crypto.crypt(payload, 18);
+        }
+        respond(payload, 18, now, n->latency_us);
+        return;
+    }
+    case AC_IO_CMD_ICCx_SET_SLOT_STATE:
+        if (n->model == ACIO_SIM_ICCA) {
+            apply_slot_state(n, request.cmd.raw[1]);
+        }
+        build_state(n, payload);
+        respond(payload, 16, now, n->latency_us);
+        return;
+    default:
+        respond(&status, 1, now, n->latency_us);
+        return;
+    }
+}
+
+void ACIOSim::handle_frame(uint64_t now)
+{
+    if (request.addr == 0) {
+        /* broadcast, only address assignment is answered */
+        if (ac_io_u16(request.cmd.code) == AC_IO_CMD_ASSIGN_ADDRS) {
+            uint8_t node_count = count;
+            for (int i = 0; i < count; i++) {
+                nodes[i].addressed = true;
+            }
+            respond(&node_count, 1, now, ACIO_SIM_DEFAULT_LATENCY_US);
+        }
+        return;
+    }
+
+    int index = request.addr - 1;
+    if (index < 0 || index >= count || !nodes[index].addressed) {
+        return;
+    }
+    handle_node_command(&nodes[index], now);
+}
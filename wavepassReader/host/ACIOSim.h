@@ -0,0 +1,94 @@
+#ifndef acio_sim_h
+#define acio_sim_h
+
+#include <stdint.h>
+#include "ACIOBus.h"
+#include "Cipher.h"
+
+/* Software ACIO bus for host builds.
+   Speaks the wire protocol of a chain of ICCA/ICCB/ICCC readers, with
+   scriptable cards, keypads, slot mechanics and timing quirks, so the
+   real reader stack can run against it through the host HAL. */
+
+#define ACIO_SIM_MAX_NODES 8
+
+enum acio_sim_model {
+    ACIO_SIM_ICCA, /* slotted, plain polling only */
+    ACIO_SIM_ICCB, /* wavepass, encrypted FeliCa polling */
+    ACIO_SIM_ICCC,
+};
+
+enum acio_sim_card_pos {
+    ACIO_SIM_CARD_NONE,
+    ACIO_SIM_CARD_FRONT,    /* ICCA: front sensor only, shutter closed or ejected */
+    ACIO_SIM_CARD_INSERTED, /* ICCA: both sensors, on the others: on the reader */
+};
+
+struct acio_sim_node {
+    enum acio_sim_model model;
+    char product[4];
+    uint32_t max_baudrate;
+    uint32_t latency_us;         /* command received to first response byte */
+    uint32_t min_engage_gap_us; /* encrypted polls sooner than this after an
+                                   ENGAGE go unanswered */
+    bool addressed; /* enumerated since power on, ignores commands until then */
+    bool started;
+    bool keyed;
+    Cipher crypto;
+    uint8_t dev_key[4];
+
+    /* card */
+    enum acio_sim_card_pos card_pos;
+    uint8_t card_type;
+    uint8_t uid[8];
+    bool uid_read; /* an ENGAGE happened since the card arrived */
+
+    /* ICCA slot */
+    uint8_t slot_state;
+    bool ejected_event;
+
+    /* keypad */
+    uint16_t key_state;
+    uint8_t key_events[2];
+    uint8_t key_seq;
+
+    uint64_t engaged_us; /* last ENGAGE */
+    uint32_t commands;
+    uint32_t slot_commands;
+    uint32_t ejects;       /* cards pushed out by a slot eject */
+    uint32_t early_polls;
+};
+
+class ACIOSim : public ACIOBus
+{
+public:
+    ACIOSim();
+
+    /* remove every node and drop anything in flight */
+    void reset();
+    int add_node(enum acio_sim_model model);
+    struct acio_sim_node *node(int index);
+    int node_count() const;
+
+    /* scripting */
+    void set_powered(bool powered);
+    void place_card(int index, const uint8_t uid[8], uint8_t card_type);
+    void remove_card(int index);
+    void set_keys(int index, uint16_t key_state);
+    /* advance the node's keystream, as if an answer got lost */
+    void desync_keystream(int index, int bytes);
+
+protected:
+    void handle_frame(uint64_t now);
+    uint32_t max_baudrate() const;
+
+private:
+    void handle_node_command(struct acio_sim_node *n, uint64_t now);
+    void build_state(const struct acio_sim_node *n, uint8_t state[16]) const;
+    void apply_slot_state(struct acio_sim_node *n, uint8_t slot_state);
+
+    struct acio_sim_node nodes[ACIO_SIM_MAX_NODES];
+    int count;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include "CaptureTrace.h"
+#include "ACIOFrame.h"
+#include <stdio.h>
+#include <string.h>
+
+bool capture_trace_load(const char *path, std::vector<capture_trace_frame> &frames)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return false;
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(f);
+
+    size_t pos = 0;
+    uint32_t last = 0;
+    uint64_t base = 0;
+    bool first = true;
+
+    while (pos + sizeof(struct capture_record) <= data.size()) {
+        struct capture_record record;
+        memcpy(&record, &data[pos], sizeof(record));
+
+        /* the reader may have joined mid-record, look for the next sane header */
+        if (record.sync != CAPTURE_SYNC || (record.flags & CAPTURE_STATUS_MASK) > CAPTURE_DECRYPTED ||
+            record.length > ACIO_FRAME_MAX_SIZE ||
+            pos + sizeof(record) + record.length > data.size()) {
+            pos++;
+            continue;
+        }
+
+        /* the device only keeps the low 32 bits */
+        if (first) {
+            base = 0;
+            last = record.time_us;
+            first = false;
+        }
+        base += (uint32_t)(record.time_us - last);
+        last = record.time_us;
+
+        capture_trace_frame frame;
+        frame.time_us = base;
+        frame.rx = record.flags & CAPTURE_DIR_RX;
+        frame.status = (enum capture_status)(record.flags & CAPTURE_STATUS_MASK);
+        frame.overflow = record.flags & CAPTURE_OVERFLOW;
+        frame.node = record.node;
+        frame.bytes.assign(data.begin() + pos + sizeof(record),
+                           data.begin() + pos + sizeof(record) + record.length);
+        frames.push_back(frame);
+
+        pos += sizeof(record) + record.length;
+    }
+
+    return true;
+}
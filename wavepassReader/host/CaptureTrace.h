@@ -0,0 +1,23 @@
+#ifndef capture_trace_h
+#define capture_trace_h
+
+#include <stdint.h>
+#include <vector>
+#include "Capture.h"
+
+/* Reader for the binary stream produced by Capture.cpp. */
+
+struct capture_trace_frame {
+    uint64_t time_us; /* unwrapped, relative to the first record */
+    bool rx;
+    enum capture_status status;
+    bool overflow; /* records were lost right before this one */
+    uint8_t node;
+    std::vector<uint8_t> bytes; /* unescaped frame, checksum excluded */
+};
+
+/* Parse a whole capture file, skipping garbage between records.
+   Returns false if the file can't be read. */
+bool capture_trace_load(const char *path, std::vector<capture_trace_frame> &frames);
+
+#endif
@@ -0,0 +1,228 @@
+#include "HALHost.h"
+#include "ACIOBus.h"
+#include "RingBuffer.h"
+#include <deque>
+
+struct hal_host_byte {
+    uint64_t time; /* when the last bit arrives at the other end */
+    uint8_t value;
+};
+
+static ACIOBus *bus;
+static uint64_t now_us;
+static uint32_t uart_baudrate = ACIO_DEFAULT_BAUDRATE;
+static uint64_t tx_line_free_us;
+static std::deque<hal_host_byte> tx_line;
+static RingBuffer<HAL_UART_RX_BUFFER_SIZE> rx_ring;
+static uint32_t rx_bytes;
+static uint32_t rx_irqs;
+static uint32_t gpio_low;
+static void (*idle_hook)();
+static bool in_idle_hook;
+
+/* hand over everything that arrived by now, in both directions */
+static void hal_host_pump()
+{
+    while (!tx_line.empty() && tx_line.front().time <= now_us) {
+        if (bus != NULL) {
+            bus->receive(tx_line.front().value, tx_line.front().time);
+        }
+        tx_line.pop_front();
+    }
+
+    if (bus == NULL) {
+        return;
+    }
+
+    uint8_t chunk[32];
+    int n;
+    while ((n = bus->transmit(chunk, sizeof(chunk), now_us)) > 0) {
+        rx_irqs++;
+        for (int i = 0; i < n; i++) {
+            rx_ring.push(chunk[i]);
+        }
+        rx_bytes += n;
+    }
+}
+
+/* earliest pending bus event, 0 if there is none */
+static uint64_t hal_host_next_event()
+{
+    uint64_t next = 0;
+
+    if (!tx_line.empty()) {
+        next = tx_line.front().time;
+    }
+    if (bus != NULL && bus->has_output()) {
+        uint64_t out = bus->next_output_time();
+        if (next == 0 || out < next) {
+            next = out;
+        }
+    }
+    return next;
+}
+
+/* step through the bus events on the way, so the nodes see the
+   requests at the time they really arrive */
+void hal_host_advance_us(uint64_t us)
+{
+    uint64_t target = now_us + us;
+
+    for (;;) {
+        uint64_t next = hal_host_next_event();
+        if (next == 0 || next > target) {
+            break;
+        }
+        if (next > now_us) {
+            now_us = next;
+        }
+        hal_host_pump();
+    }
+    now_us = target;
+    hal_host_pump();
+}
+
+void hal_host_attach(ACIOBus *device)
+{
+    bus = device;
+    if (bus != NULL) {
+        bus->set_baudrate(uart_baudrate);
+    }
+}
+
+void hal_host_reset()
+{
+    now_us = 0;
+    tx_line_free_us = 0;
+    tx_line.clear();
+    rx_ring.clear();
+    rx_bytes = 0;
+    rx_irqs = 0;
+    gpio_low = 0;
+    idle_hook = NULL;
+}
+
+void hal_host_set_gpio(uint8_t pin, bool level)
+{
+    if (level) {
+        gpio_low &= ~(1u << pin);
+    } else {
+        gpio_low |= 1u << pin;
+    }
+}
+
+void hal_uart_init(uint32_t baudrate)
+{
+    hal_uart_set_baudrate(baudrate);
+    rx_ring.clear();
+}
+
+uint32_t hal_uart_set_baudrate(uint32_t baudrate)
+{
+    /* let pending output leave at the old rate */
+    if (tx_line_free_us > now_us) {
+        hal_host_advance_us(tx_line_free_us - now_us);
+    }
+    uart_baudrate = baudrate;
+    if (bus != NULL) {
+        bus->set_baudrate(baudrate);
+    }
+    return baudrate;
+}
+
+int hal_uart_available()
+{
+    hal_host_pump();
+    return rx_ring.available();
+}
+
+int hal_uart_read(uint8_t *buffer, int size)
+{
+    hal_host_pump();
+    return rx_ring.read(buffer, size);
+}
+
+bool hal_uart_write(const uint8_t *buffer, int length)
+{
+    for (int i = 0; i < length; i++) {
+        hal_uart_putc(buffer[i]);
+    }
+    return true;
+}
+
+void hal_uart_putc(uint8_t value)
+{
+    uint64_t start = tx_line_free_us > now_us ? tx_line_free_us : now_us;
+
+    /* 8N1, 10 bits per byte */
+    tx_line_free_us = start + (10 * 1000000 + uart_baudrate - 1) / uart_baudrate;
+    tx_line.push_back({tx_line_free_us, value});
+}
+
+void hal_uart_flush_rx()
+{
+    hal_host_pump();
+    rx_ring.clear();
+}
+
+void hal_uart_get_stats(struct hal_uart_stats *stats)
+{
+    stats->rx_bytes = rx_bytes;
+    stats->rx_dropped = rx_ring.dropped_count();
+    stats->rx_overruns = 0;
+    stats->rx_irqs = rx_irqs;
+}
+
+uint64_t hal_time_us()
+{
+    return now_us;
+}
+
+static void hal_host_run_idle_hook()
+{
+    if (idle_hook != NULL && !in_idle_hook) {
+        in_idle_hook = true;
+        idle_hook();
+        in_idle_hook = false;
+    }
+}
+
+void hal_sleep_ms(uint32_t ms)
+{
+    hal_sleep_us((uint64_t)ms * 1000);
+}
+
+/* the virtual clock jumps, the hook runs once at the end */
+void hal_sleep_us(uint64_t us)
+{
+    hal_host_advance_us(us);
+    hal_host_run_idle_hook();
+}
+
+/* jump to the next thing happening on the bus */
+void hal_idle()
+{
+    uint64_t next = hal_host_next_event();
+
+    if (next > now_us) {
+        hal_host_advance_us(next - now_us);
+    } else {
+        hal_host_advance_us(next == 0 ? HAL_HOST_IDLE_US : 0);
+    }
+    hal_host_run_idle_hook();
+}
+
+void hal_set_idle_hook(void (*hook)())
+{
+    idle_hook = hook;
+}
+
+void hal_gpio_init_pullup(uint8_t pin)
+{
+    gpio_low &= ~(1u << pin);
+}
+
+bool hal_gpio_get(uint8_t pin)
+{
+    return !(gpio_low & (1u << pin));
+}
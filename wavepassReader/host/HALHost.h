@@ -0,0 +1,21 @@
+#ifndef hal_host_h
+#define hal_host_h
+
+#include <stdint.h>
+#include "HAL.h"
+
+class ACIOBus;
+
+/* Host side of the HAL: time only moves when the stack sleeps or idles,
+   bytes cross the simulated bus with the timing of the current baudrate. */
+
+/* idle step when nothing is scheduled on the bus */
+#define HAL_HOST_IDLE_US 100
+
+void hal_host_attach(ACIOBus *device);
+/* back to time zero with empty lines */
+void hal_host_reset();
+void hal_host_advance_us(uint64_t us);
+void hal_host_set_gpio(uint8_t pin, bool level);
+
+#endif
@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "ACIO.h"
+#include "ACIOFrame.h"
+#include "Cipher.h"
+#include "ICCx.h"
+#include "RingBuffer.h"
+
+/* Micro-benchmarks for the per-poll hot path: keystream, CRC, frame
+   escaping and decoding, with the old send_buf encoder timed next to
+   acio_frame_encode() and the stack both take printed after the table.
+   The Cipher golden vectors and the RingBuffer checks run first, any
+   mismatch exits with 1.
+   usage: wavepass_bench [--json out.json] [--compare baseline.json] [--tolerance percent]
+   With --compare, exits non-zero when a case got slower than the baseline
+   by more than the tolerance (default 25%). */
+
+#define BENCH_MIN_NS 50000000LL /* time batches of at least 50ms */
+#define BENCH_REPEATS 5           /* and keep the fastest, the rest is noise */
+#define BENCH_DEFAULT_TOLERANCE 25
+#define BENCH_MAX_CASES 16
+
+struct bench_result {
+    const char *name;
+    int bytes;          /* payload bytes processed per call */
+    double ns_per_byte;
+    double frames_per_s; /* calls per second */
+};
+
+static struct bench_result bench_results[BENCH_MAX_CASES];
+static int bench_count;
+static volatile uint32_t bench_sink;
+
+typedef void (*bench_fn_t)(void *ctx);
+
+static int64_t bench_now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/* doubles the batch until it runs long enough to time reliably, then
+   keeps the best of a few batches */
+static void bench_run(const char *name, int bytes, bench_fn_t fn, void *ctx)
+{
+    long iterations = 1024;
+    int64_t elapsed;
+
+    for (int i = 0; i < 1024; i++) {
+        fn(ctx);
+    }
+    for (;;) {
+        int64_t start = bench_now_ns();
+        for (long i = 0; i < iterations; i++) {
+            fn(ctx);
+        }
+        elapsed = bench_now_ns() - start;
+        if (elapsed >= BENCH_MIN_NS) {
+            break;
+        }
+        iterations *= 2;
+    }
+    for (int repeat = 1; repeat < BENCH_REPEATS; repeat++) {
+        int64_t start = bench_now_ns();
+        for (long i = 0; i < iterations; i++) {
+            fn(ctx);
+        }
+        int64_t batch = bench_now_ns() - start;
+        if (batch < elapsed) {
+            elapsed = batch;
+        }
+    }
+
+    struct bench_result *r = &bench_results[bench_count++];
+    r->name = name;
+    r->bytes = bytes;
+    r->ns_per_byte = (double)elapsed / iterations / bytes;
+    r->frames_per_s = iterations * 1e9 / elapsed;
+}
+
+/* cases */
+
+struct bench_crypt_ctx {
+    Cipher cipher;
+    uint8_t data[0xFF + 8] __attribute__((aligned(4)));
+    int offset;
+    int length;
+};
+
+static void bench_crypt(void *ctx)
+{
+    struct bench_crypt_ctx *c = (struct bench_crypt_ctx *)ctx;
+    c->cipher.crypt(c->data + c->offset, c->length);
+    bench_sink += c->data[0];
+}
+
+/* an encrypted FEL_POLL answer the way ICCx used to take it: decrypt in
+   place, CRC the plaintext, copy the state out */
+static void bench_poll_split(void *ctx)
+{
+    struct bench_crypt_ctx *c = (struct bench_crypt_ctx *)ctx;
+    uint8_t *raw = c->data + c->offset;
+    iccx_state_t state;
+
+    c->cipher.crypt(raw, 18);
+    uint16_t crc = raw[16] << 8 | raw[17];
+    bool ok = Cipher::CRCCCITT(raw, 16) == crc;
+    memcpy(&state, raw, sizeof(state));
+    bench_sink += ok + state.key_state;
+}
+
+/* and the way it does now, in one pass */
+static void bench_poll_fused(void *ctx)
+{
+    struct bench_crypt_ctx *c = (struct bench_crypt_ctx *)ctx;
+    iccx_state_t state;
+    uint16_t crc;
+
+    bool ok = c->cipher.decryptChecked(c->data + c->offset, (unsigned char *)&state, sizeof(state), &crc);
+    bench_sink += ok + state.key_state;
+}
+
+struct bench_buffer_ctx {
+    uint8_t data[ACIO_FRAME_MAX_ENCODED_SIZE(ACIO_FRAME_MAX_SIZE)];
+    int length;
+    struct ac_io_message msg;
+    ACIODecoder decoder;
+    int out;
+    uintptr_t stack_low; /* deepest sink frame seen, for bench_stack_use() */
+};
+
+static void bench_crc(void *ctx)
+{
+    struct bench_buffer_ctx *c = (struct bench_buffer_ctx *)ctx;
+    bench_sink += Cipher::CRCCCITTByteWise(c->data, c->length);
+}
+
+#ifdef CIPHER_CRC_SLICE_BY_4
+static void bench_crc_slice4(void *ctx)
+{
+    struct bench_buffer_ctx *c = (struct bench_buffer_ctx *)ctx;
+    bench_sink += Cipher::CRCCCITTSlice4(c->data, c->length);
+}
+#endif
+
+static bool bench_copy_sink(const uint8_t *data, int length, void *ctx)
+{
+    struct bench_buffer_ctx *c = (struct bench_buffer_ctx *)ctx;
+    memcpy(c->data + c->out, data, length);
+    c->out += length;
+    return true;
+}
+
+/* both encoders get the sink through this, so neither has it inlined
+   into a clone of itself; the firmware's sink is another unit's too */
+static acio_frame_sink_t volatile bench_encode_sink = bench_copy_sink;
+
+static void bench_encode(void *ctx)
+{
+    struct bench_buffer_ctx *c = (struct bench_buffer_ctx *)ctx;
+    c->out = 0;
+    bench_sink += acio_frame_encode((const uint8_t *)&c->msg, c->length, bench_encode_sink, c);
+}
+
+typedef int (*bench_encoder_t)(const uint8_t *buffer, int length, acio_frame_sink_t sink, void *ctx);
+
+/* the acio_send() encoder acio_frame_encode() replaced: the whole frame
+   escaped into a 512 byte stack buffer, then handed over in one write.
+   Like the original it only checks the unescaped length, a frame that
+   escapes past 512 bytes overruns it, so it's only timed on the poll. */
+static int __attribute__((noinline)) bench_encode_send_buf(const uint8_t *buffer, int length,
+                                                           acio_frame_sink_t sink, void *ctx)
+{
+    uint8_t send_buf[512];
+    int send_buf_pos = 0;
+    uint8_t checksum = 0;
+
+    if (length > (int)sizeof(send_buf)) {
+        return -1;
+    }
+
+    send_buf[send_buf_pos++] = AC_IO_SOF;
+    for (int i = 0; i < length; i++) {
+        if (buffer[i] == AC_IO_SOF || buffer[i] == AC_IO_ESCAPE) {
+            send_buf[send_buf_pos++] = AC_IO_ESCAPE;
+            send_buf[send_buf_pos++] = ~buffer[i];
+        } else {
+            send_buf[send_buf_pos++] = buffer[i];
+        }
+        checksum += buffer[i];
+    }
+    if (checksum == AC_IO_SOF || checksum == AC_IO_ESCAPE) {
+        send_buf[send_buf_pos++] = AC_IO_ESCAPE;
+        send_buf[send_buf_pos++] = ~checksum;
+    } else {
+        send_buf[send_buf_pos++] = checksum;
+    }
+
+    return sink(send_buf, send_buf_pos, ctx) ? send_buf_pos : -1;
+}
+
+static void bench_encode_old(void *ctx)
+{
+    struct bench_buffer_ctx *c = (struct bench_buffer_ctx *)ctx;
+    c->out = 0;
+    bench_sink += bench_encode_send_buf((const uint8_t *)&c->msg, c->length, bench_encode_sink, c);
+}
+
+static bool bench_stack_sink(const uint8_t *data, int length, void *ctx)
+{
+    struct bench_buffer_ctx *c = (struct bench_buffer_ctx *)ctx;
+    uintptr_t frame = (uintptr_t)__builtin_frame_address(0);
+    if (frame < c->stack_low) {
+        c->stack_low = frame;
+    }
+    return bench_copy_sink(data, length, ctx);
+}
+
+/* stack an encoder takes between its caller and the sink it feeds, the
+   same sink for both so the difference is the encoder's own frame */
+static int __attribute__((noinline)) bench_stack_use(bench_encoder_t encode, struct bench_buffer_ctx *c)
+{
+    uintptr_t top = (uintptr_t)__builtin_frame_address(0);
+    c->stack_low = top;
+    c->out = 0;
+    if (encode((const uint8_t *)&c->msg, c->length, bench_stack_sink, c) < 0) {
+        return -1;
+    }
+    return (int)(top - c->stack_low);
+}
+
+static void bench_decode(void *ctx)
+{
+    struct bench_buffer_ctx *c = (struct bench_buffer_ctx *)ctx;
+    int consumed;
+    c->decoder.begin(&c->msg);
+    bench_sink += c->decoder.push(c->data, c->length, &consumed);
+}
+
+/* FEL_POLL response: 16 bytes of state plus the CRC */
+static void bench_fill_poll(struct ac_io_message *msg)
+{
+    msg->addr = 0x81;
+    msg->cmd.code = ac_io_u16(AC_IO_CMD_ICCx_FEL_POLL);
+    msg->cmd.seq_no = 0x12;
+    msg->cmd.nbytes = 18;
+    for (int i = 0; i < 18; i++) {
+        msg->cmd.raw[i] = (uint8_t)(i * 37 + 11);
+    }
+}
+
+/* every byte of the frame needs escaping */
+static void bench_fill_worst(struct ac_io_message *msg)
+{
+    msg->addr = AC_IO_SOF;
+    msg->cmd.code = AC_IO_SOF << 8 | AC_IO_SOF;
+    msg->cmd.seq_no = AC_IO_SOF;
+    msg->cmd.nbytes = AC_IO_ESCAPE;
+    memset(msg->cmd.raw, AC_IO_SOF, 0xFF);
+}
+
+/* both encoders agree on every length the send_buf one can hold, with
+   escapes landing on either side of acio_frame_encode()'s chunk edges */
+static bool bench_check_encode()
+{
+    static struct bench_buffer_ctx a;
+    static struct bench_buffer_ctx b;
+    uint8_t *raw = (uint8_t *)&a.msg;
+
+    for (int i = 0; i < (int)ACIO_FRAME_MAX_SIZE; i++) {
+        raw[i] = (i % 3 == 0) ? AC_IO_SOF : (i % 7 == 0) ? AC_IO_ESCAPE : (uint8_t)(i * 37 + 11);
+    }
+    b.msg = a.msg;
+    for (int length = 0; ACIO_FRAME_MAX_ENCODED_SIZE(length) <= 512; length++) {
+        a.length = b.length = length;
+        bench_encode(&a);
+        bench_encode_old(&b);
+        if (a.out != b.out || memcmp(a.data, b.data, a.out) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int bench_stack_new;
+static int bench_stack_old;
+
+static void bench_frames()
+{
+    static struct bench_buffer_ctx poll;
+    static struct bench_buffer_ctx worst;
+    int poll_size = offsetof(struct ac_io_message, cmd.raw) + 18;
+    int worst_size = ACIO_FRAME_MAX_SIZE;
+
+    if (!bench_check_encode()) {
+        fprintf(stderr, "acio_frame_encode doesn't match the send_buf encoder\n");
+        exit(2);
+    }
+
+    bench_fill_poll(&poll.msg);
+    poll.length = poll_size;
+    bench_run("encode_poll_18", poll_size, bench_encode, &poll);
+    bench_run("encode_poll_18_old", poll_size, bench_encode_old, &poll);
+    bench_encode_old(&poll);
+    int old_out = poll.out;
+    uint8_t old_frame[64];
+    memcpy(old_frame, poll.data, old_out);
+    bench_stack_old = bench_stack_use(bench_encode_send_buf, &poll);
+    bench_stack_new = bench_stack_use(acio_frame_encode, &poll);
+    bench_encode(&poll);
+    if (poll.out != old_out || memcmp(poll.data, old_frame, old_out) != 0) {
+        fprintf(stderr, "acio_frame_encode doesn't match the send_buf encoder\n");
+        exit(2);
+    }
+
+    bench_fill_worst(&worst.msg);
+    worst.length = worst_size;
+    bench_run("encode_escaped_255", worst_size, bench_encode, &worst);
+
+    /* decode what was just encoded, timing a decoder that rejects it is pointless */
+    poll.length = poll.out;
+    worst.length = worst.out;
+    struct bench_buffer_ctx *encoded[] = {&poll, &worst};
+    for (struct bench_buffer_ctx *c : encoded) {
+        int consumed;
+        c->decoder.begin(&c->msg);
+        if (c->decoder.push(c->data, c->length, &consumed) != ACIO_DECODE_FRAME) {
+            fprintf(stderr, "encoded frame doesn't decode\n");
+            exit(2);
+        }
+    }
+    bench_run("decode_poll_18", poll_size, bench_decode, &poll);
+    bench_run("decode_escaped_255", worst_size, bench_decode, &worst);
+}
+
+/* keystream of setKeys(0x2923be84, 0x5c710ea3) for an 18 then a 7 byte
+   call, and the CRC of a following 255 byte call over 0..254, as produced
+   by the original byte-wise crypt() */
+static const uint8_t bench_golden_18[18] = {
+    0xb4, 0x31, 0x09, 0xdd, 0xa7, 0x13, 0x45, 0x76, 0x1d,
+    0xb1, 0x44, 0xa8, 0x84, 0xfc, 0x0e, 0x13, 0xb8, 0xbf,
+};
+static const uint8_t bench_golden_7[7] = {0x85, 0xba, 0x5a, 0x24, 0x12, 0xb9, 0xda};
+#define BENCH_GOLDEN_CRC_255 0x97f2
+
+/* crypt() must stay bit-identical at every buffer alignment */
+static bool bench_check_cipher()
+{
+    static uint8_t buffer[0xFF + 4] __attribute__((aligned(4)));
+
+    for (int offset = 0; offset < 4; offset++) {
+        Cipher cipher;
+        uint8_t *data = buffer + offset;
+        cipher.setKeys(0x2923be84, 0x5c710ea3);
+
+        /* odd offsets take the keystream precomputed, refill() must not
+           change it */
+        if (offset & 1) {
+            cipher.refill();
+        }
+        memset(data, 0, 18);
+        cipher.crypt(data, 18);
+        if (memcmp(data, bench_golden_18, 18) != 0) {
+            return false;
+        }
+        if (offset & 1) {
+            cipher.refill();
+        }
+        memset(data, 0, 7);
+        cipher.crypt(data, 7);
+        if (memcmp(data, bench_golden_7, 7) != 0) {
+            return false;
+        }
+        for (int i = 0; i < 0xFF; i++) {
+            data[i] = i;
+        }
+        cipher.crypt(data, 0xFF);
+        if (Cipher::CRCCCITT(data, 0xFF) != BENCH_GOLDEN_CRC_255) {
+            return false;
+        }
+        /* the fused poll decrypt must match crypt() and the CRC, first on
+           a valid answer, then on ones the keystream no longer fits */
+        Cipher sender;
+        Cipher split;
+        Cipher fused;
+        sender.setKeys(0x2923be84, 0x5c710ea3);
+        split.setKeys(0x2923be84, 0x5c710ea3);
+        fused.setKeys(0x2923be84, 0x5c710ea3);
+        for (int i = 0; i < 16; i++) {
+            data[i] = i * 7;
+        }
+        uint16_t crc = Cipher::CRCCCITT(data, 16);
+        data[16] = crc >> 8;
+        data[17] = crc & 0xFF;
+        sender.crypt(data, 18);
+        for (int round = 0; round < 3; round++) {
+            uint8_t plain[18];
+            uint8_t out[16];
+            memcpy(plain, data, 18);
+            split.crypt(plain, 18);
+            fused.refill();
+            bool valid = Cipher::CRCCCITT(plain, 16) == (plain[16] << 8 | plain[17]);
+            if (fused.decryptChecked(data, out, 16, &crc) != valid || valid != (round == 0) ||
+                memcmp(out, plain, 16) != 0 || crc != (plain[16] << 8 | plain[17])) {
+                return false;
+            }
+        }
+#ifdef CIPHER_CRC_SLICE_BY_4
+        /* both CRC variants over every length and alignment */
+        for (int length = 0; length <= 0xFF; length++) {
+            if (Cipher::CRCCCITTSlice4(data, length) != Cipher::CRCCCITTByteWise(data, length)) {
+                return false;
+            }
+        }
+#endif
+    }
+    return true;
+}
+
+/* byte source standing in for the UART IRQ, a counter so every byte
+   read back can be checked against its position in the stream */
+static uint8_t bench_ring_source;
+
+static int bench_ring_feed(RingBuffer<16> *ring, int count)
+{
+    int pushed = 0;
+    for (int i = 0; i < count; i++) {
+        if (ring->push(bench_ring_source)) {
+            pushed++;
+        }
+        bench_ring_source++;
+    }
+    return pushed;
+}
+
+/* RingBuffer on a small ring: fill past N, read across the wrap, and the
+   all or nothing write() */
+static bool bench_check_ring()
+{
+    static RingBuffer<16> ring;
+    uint8_t out[32];
+
+    bench_ring_source = 0;
+
+    /* 20 bytes into 16: the last 4 are dropped, the first 16 come back */
+    if (bench_ring_feed(&ring, 20) != 16 || ring.available() != 16 || ring.free() != 0 ||
+        ring.dropped_count() != 4) {
+        return false;
+    }
+    if (ring.read(out, 10) != 10) {
+        return false;
+    }
+    for (int i = 0; i < 10; i++) {
+        if (out[i] != i) {
+            return false;
+        }
+    }
+
+    /* head wraps: 10 more fit, stream bytes 20..29 */
+    if (bench_ring_feed(&ring, 10) != 10 || ring.available() != 16) {
+        return false;
+    }
+    if (ring.read(out, sizeof(out)) != 16) {
+        return false;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (out[i] != 10 + i) {
+            return false;
+        }
+    }
+    for (int i = 0; i < 10; i++) {
+        if (out[6 + i] != 20 + i) {
+            return false;
+        }
+    }
+    if (ring.available() != 0 || ring.read(out, sizeof(out)) != 0) {
+        return false;
+    }
+
+    /* write() across the wrap, then one that doesn't fit leaves the ring
+       as it was and counts every byte as dropped */
+    uint8_t record[12];
+    for (int i = 0; i < 12; i++) {
+        record[i] = 0xA0 + i;
+    }
+    if (!ring.write(record, 12) || ring.write(record, 5) || ring.available() != 12 ||
+        ring.dropped_count() != 4 + 5) {
+        return false;
+    }
+    if (ring.read(out, sizeof(out)) != 12 || memcmp(out, record, 12) != 0) {
+        return false;
+    }
+
+    /* clear() drops what's pending but not what comes next */
+    bench_ring_feed(&ring, 3);
+    ring.clear();
+    if (bench_ring_feed(&ring, 2) != 2 || ring.read(out, sizeof(out)) != 2 ||
+        out[0] != (uint8_t)(bench_ring_source - 2)) {
+        return false;
+    }
+    return true;
+}
+
+static void bench_cipher()
+{
+    static struct bench_crypt_ctx crypt;
+    static struct bench_buffer_ctx crc;
+
+    crypt.cipher.setKeys(0x2923be84, 0x5c710ea3);
+    memset(crypt.data, 0x5A, sizeof(crypt.data));
+    crypt.length = 18;
+    bench_run("crypt_18", 18, bench_crypt, &crypt);
+    /* where it really runs: msg.cmd.raw sits at offset 5 */
+    crypt.offset = offsetof(struct ac_io_message, cmd.raw);
+    bench_run("crypt_18_unaligned", 18, bench_crypt, &crypt);
+    bench_run("poll_split_18", 18, bench_poll_split, &crypt);
+    bench_run("poll_fused_18", 18, bench_poll_fused, &crypt);
+    crypt.offset = 0;
+    crypt.length = 0xFF;
+    bench_run("crypt_255", 0xFF, bench_crypt, &crypt);
+
+    for (int i = 0; i < 0xFF; i++) {
+        crc.data[i] = (uint8_t)(i * 37 + 11);
+    }
+    crc.length = 16;
+    bench_run("crc_16", 16, bench_crc, &crc);
+    crc.length = 0xFF;
+    bench_run("crc_255", 0xFF, bench_crc, &crc);
+#ifdef CIPHER_CRC_SLICE_BY_4
+    crc.length = 16;
+    bench_run("crc_16_slice4", 16, bench_crc_slice4, &crc);
+    crc.length = 0xFF;
+    bench_run("crc_255_slice4", 0xFF, bench_crc_slice4, &crc);
+#endif
+}
+
+static bool bench_write_json(const char *path)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (f == NULL) {
+        return false;
+    }
+
+    /* one case per line, --compare relies on it */
+    fprintf(f, "{\n  \"benchmarks\": [\n");
+    for (int i = 0; i < bench_count; i++) {
+        struct bench_result *r = &bench_results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"bytes\": %d, \"ns_per_byte\": %.3f, \"frames_per_s\": %.0f}%s\n",
+                r->name, r->bytes, r->ns_per_byte, r->frames_per_s, i + 1 < bench_count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    if (f != stdout) {
+        fclose(f);
+    }
+    return true;
+}
+
+/* returns the number of cases slower than the baseline, -1 if unreadable */
+static int bench_compare(const char *path, int tolerance)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    int regressions = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[64];
+        int bytes;
+        double ns_per_byte;
+        const char *entry = strstr(line, "{\"name\"");
+        if (entry == NULL ||
+            sscanf(entry, "{\"name\": \"%63[^\"]\", \"bytes\": %d, \"ns_per_byte\": %lf",
+                   name, &bytes, &ns_per_byte) != 3) {
+            continue;
+        }
+
+        for (int i = 0; i < bench_count; i++) {
+            struct bench_result *r = &bench_results[i];
+            if (strcmp(r->name, name) != 0) {
+                continue;
+            }
+            double change = (r->ns_per_byte / ns_per_byte - 1) * 100;
+            bool slower = change > tolerance;
+            printf("%-20s %8.3f -> %8.3f ns/byte (%+.0f%%)%s\n", name, ns_per_byte,
+                   r->ns_per_byte, change, slower ? "  REGRESSION" : "");
+            if (slower) {
+                regressions++;
+            }
+        }
+    }
+
+    fclose(f);
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    const char *json = NULL;
+    const char *baseline = NULL;
+    int tolerance = BENCH_DEFAULT_TOLERANCE;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--json out.json] [--compare baseline.json] [--tolerance percent]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    if (!bench_check_cipher()) {
+        fprintf(stderr, "Cipher::crypt doesn't match the golden vectors\n");
+        return 1;
+    }
+
+    if (!bench_check_ring()) {
+        fprintf(stderr, "RingBuffer wrap, overflow or drop count is wrong\n");
+        return 1;
+    }
+
+    bench_cipher();
+    bench_frames();
+
+    for (int i = 0; i < bench_count; i++) {
+        struct bench_result *r = &bench_results[i];
+        printf("%-20s %4d bytes %8.3f ns/byte %12.0f frames/s\n", r->name, r->bytes,
+               r->ns_per_byte, r->frames_per_s);
+    }
+    printf("encoder stack to sink: acio_frame_encode %d bytes, send_buf encoder %d bytes\n",
+           bench_stack_new, bench_stack_old);
+
+    if (json != NULL && !bench_write_json(json)) {
+        fprintf(stderr, "can't write %s\n", json);
+        return 2;
+    }
+
+    if (baseline != NULL) {
+        int regressions = bench_compare(baseline, tolerance);
+        if (regressions < 0) {
+            fprintf(stderr, "can't read %s\n", baseline);
+            return 2;
+        }
+        return regressions > 0 ? 1 : 0;
+    }
+
+    return 0;
+}
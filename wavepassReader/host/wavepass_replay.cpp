@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "HALHost.h"
+#include "ACIOReplay.h"
+#include "CaptureTrace.h"
+#include "ACIO.h"
+#include "ICCx.h"
+
+/* Replays a capture from the EAMUSE port (or wavepass_sim --capture)
+   through the reader stack on the virtual clock and reports what would
+   have reached the HID side, with timings.
+   usage: wavepass_replay trace.bin */
+
+/* keep polling this long after the last captured request */
+#define REPLAY_TAIL_US 200000
+
+static const struct {
+    uint16_t mask;
+    const char *name;
+} replay_keys[] = {
+    {ICCx_KEYPAD_MASK_0, "0"}, {ICCx_KEYPAD_MASK_1, "1"}, {ICCx_KEYPAD_MASK_2, "2"},
+    {ICCx_KEYPAD_MASK_3, "3"}, {ICCx_KEYPAD_MASK_4, "4"}, {ICCx_KEYPAD_MASK_5, "5"},
+    {ICCx_KEYPAD_MASK_6, "6"}, {ICCx_KEYPAD_MASK_7, "7"}, {ICCx_KEYPAD_MASK_8, "8"},
+    {ICCx_KEYPAD_MASK_9, "9"}, {ICCx_KEYPAD_MASK_00, "00"}, {ICCx_KEYPAD_MASK_EMPTY, "blank"},
+};
+
+struct replay_node_stats {
+    uint32_t cycles;
+    uint32_t errors;
+    uint64_t last_done_us;
+    uint64_t cycle_total_us;
+    uint64_t cycle_max_us;
+};
+
+/* time from the card's first appearance in the trace to its report.
+   The presentation is the one the answer just given comes from: the
+   stack polls on its own clock and can be served answers from ahead of
+   it, a report then comes before the trace saw the card (negative). */
+static bool replay_card_latency_us(const ACIOReplay &replay, uint8_t node_id, const uint8_t *uid,
+                                   uint64_t now, long *latency)
+{
+    bool found = false;
+
+    for (const acio_replay_card &card : replay.cards()) {
+        if (card.node_id == node_id && memcmp(card.uid, uid, 8) == 0 &&
+            card.time_us <= replay.trace_time_us(node_id)) {
+            *latency = (long)now - (long)card.time_us;
+            found = true;
+        }
+    }
+    return found;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<capture_trace_frame> frames;
+    if (!capture_trace_load(argv[1], frames)) {
+        fprintf(stderr, "can't read %s\n", argv[1]);
+        return 2;
+    }
+
+    ACIOReplay replay;
+    if (!replay.load(frames)) {
+        fprintf(stderr, "no requests in %s\n", argv[1]);
+        return 2;
+    }
+
+    printf("trace: %lu frames, %lu ms, %d nodes, %lu cards\n", (unsigned long)frames.size(),
+           (unsigned long)(replay.duration_us() / 1000), replay.node_count(),
+           (unsigned long)replay.cards().size());
+
+    hal_host_reset();
+    hal_host_attach(&replay);
+    hal_uart_init(ACIO_DEFAULT_BAUDRATE);
+
+    bool opened = acio_open();
+    printf("open: %s at %lu baud after %lu us\n", opened ? "up" : "down",
+           (unsigned long)acio_get_baudrate(), (unsigned long)hal_time_us());
+    if (!opened) {
+        return 1;
+    }
+
+    for (uint8_t i = 0; i < replay.node_count(); i++) {
+        uint64_t start = hal_time_us();
+        /* poll the way the capture did, even if the firmware that made it
+           was set up wrong for the model */
+        iccx_profile_t profile = *iccx_find_profile(acio_get_node_product(i));
+        profile.encrypted = replay.node_encrypted(i);
+        bool ready = iccx_init(i, &profile);
+        printf("init node %d (%.4s, %s): %s after %lu us\n", i, profile.product,
+               profile.encrypted ? "encrypted" : "plain", ready ? "ok" : "failed",
+               (unsigned long)(hal_time_us() - start));
+    }
+
+    struct replay_node_stats nodes[ICCX_MAX_NODES];
+    uint8_t last_type[ICCX_MAX_NODES] = {0};
+    uint16_t last_keys[ICCX_MAX_NODES] = {0};
+    memset(nodes, 0, sizeof(nodes));
+
+    while (hal_time_us() < replay.duration_us() + REPLAY_TAIL_US) {
+        iccx_scan_result_t scan;
+        iccx_scan_status_t status = iccx_service(&scan);
+
+        if (status == ICCX_SCAN_IDLE) {
+            hal_idle();
+            continue;
+        }
+
+        struct replay_node_stats *node = &nodes[scan.node_id];
+        uint64_t now = hal_time_us();
+
+        if (status == ICCX_SCAN_ERROR) {
+            node->errors++;
+            continue;
+        }
+        if (status != ICCX_SCAN_DONE) {
+            continue;
+        }
+
+        if (node->cycles > 0) {
+            uint64_t cycle = now - node->last_done_us;
+            node->cycle_total_us += cycle;
+            if (cycle > node->cycle_max_us) {
+                node->cycle_max_us = cycle;
+            }
+        }
+        node->cycles++;
+        node->last_done_us = now;
+
+        if (scan.type != last_type[scan.node_id]) {
+            printf("%8lu us node %d: ", (unsigned long)now, scan.node_id);
+            if (scan.type == 0) {
+                printf("card removed\n");
+            } else {
+                printf("%s card", scan.type == 1 ? "ISO15693" : "FeliCa");
+                for (int i = 0; i < 8; i++) {
+                    printf(" %02X", scan.uid[i]);
+                }
+                long latency;
+                if (replay_card_latency_us(replay, scan.node_id, scan.uid, now, &latency)) {
+                    if (latency >= 0) {
+                        printf(" (%ld us after the trace saw it)", latency);
+                    } else {
+                        printf(" (%ld us before the trace saw it, the replay runs ahead)", -latency);
+                    }
+                }
+                printf("\n");
+            }
+            last_type[scan.node_id] = scan.type;
+        }
+
+        uint16_t changed = scan.key_state ^ last_keys[scan.node_id];
+        for (const auto &key : replay_keys) {
+            if (changed & key.mask) {
+                printf("%8lu us node %d: key %s %s\n", (unsigned long)now, scan.node_id, key.name,
+                       (scan.key_state & key.mask) ? "pressed" : "released");
+            }
+        }
+        last_keys[scan.node_id] = scan.key_state;
+    }
+
+    struct acio_stats stats;
+    acio_get_stats(&stats);
+    printf("acio: %lu transactions, %lu retries, %lu timeouts, %lu checksum, %lu short, max latency %lu us\n",
+           (unsigned long)stats.transactions, (unsigned long)stats.retries,
+           (unsigned long)stats.timeouts, (unsigned long)stats.checksum_errors,
+           (unsigned long)stats.short_responses, (unsigned long)stats.max_latency_us);
+    printf("replay: %lu answered, %lu unanswered, %lu skipped, %lu synthesized\n",
+           (unsigned long)replay.replay_stats.answered, (unsigned long)replay.replay_stats.unanswered,
+           (unsigned long)replay.replay_stats.skipped, (unsigned long)replay.replay_stats.synthesized);
+
+    for (uint8_t i = 0; i < replay.node_count(); i++) {
+        struct replay_node_stats *node = &nodes[i];
+        unsigned long avg = node->cycles > 1 ? (unsigned long)(node->cycle_total_us / (node->cycles - 1)) : 0;
+        printf("node %d: %lu cycles, %lu errors, cycle avg %lu us, max %lu us\n", i,
+               (unsigned long)node->cycles, (unsigned long)node->errors, avg,
+               (unsigned long)node->cycle_max_us);
+    }
+
+    return 0;
+}
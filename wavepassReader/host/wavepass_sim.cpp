@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "HALHost.h"
+#include "ACIOSim.h"
+#include "ACIO.h"
+#include "ICCx.h"
+#include "Capture.h"
+#include "CardCache.h"
+#include "Link.h"
+
+/* Runs the reader stack against a simulated bus on the virtual clock.
+   usage: wavepass_sim [--capture trace.bin] [--held-pin] [icca|iccb|iccc]...  (default: iccb iccc)
+   Every node gets a card placed, a PIN typed while it's there, a key
+   pressed, a key tapped between two polls and, when encrypted, its
+   keystream knocked out of sync once, then the card back, lifted for a
+   moment and gone. A slotted ICCA also gets a card it can't read, which
+   has to be ejected. Cards go through the same cache as on the pico and
+   key changes are printed with their keypress to report latency. Last,
+   the readers lose power for a moment and the link has to come back.
+   Exits non-zero if a node didn't report each presentation of its card
+   once, kept the unreadable card or lost a key press, or if the link
+   didn't recover.
+   --held-pin runs a keypad scenario instead: every node gets its card,
+   which stays there, and once pacing has settled a long PIN is typed on
+   each reader at once. No power blip, so the key latencies only measure
+   the keypad polling.
+   --capture writes the bus traffic in the format the firmware streams
+   over its EAMUSE port, for wavepass_replay. */
+
+#define SIM_RUN_US 9000000
+/* the power blip, from the start of the run */
+#define SIM_BLIP_US 6000000
+#define SIM_BLIP_LENGTH_US 300000
+/* first bring-up */
+#define SIM_BRINGUP_US 10000000
+/* shorter than the pico's, so the card can come back within the run */
+#define SIM_CARD_HOLDOFF_US 1000000
+/* --held-pin: keys typed from here on, staggered per node, 200ms each */
+#define SIM_HELD_PIN_START_US 2500000
+#define SIM_HELD_PIN_KEYS 30
+
+static const uint8_t sim_uid[8] = {0xE0, 0x04, 0x01, 0x00, 0x12, 0x34, 0x56, 0x78};
+static const uint16_t sim_pin[4] = {ICCx_KEYPAD_MASK_2, ICCx_KEYPAD_MASK_5, ICCx_KEYPAD_MASK_8, ICCx_KEYPAD_MASK_0};
+
+static bool sim_parse_model(const char *name, enum acio_sim_model *model)
+{
+    if (strcmp(name, "icca") == 0) {
+        *model = ACIO_SIM_ICCA;
+    } else if (strcmp(name, "iccb") == 0) {
+        *model = ACIO_SIM_ICCB;
+    } else if (strcmp(name, "iccc") == 0) {
+        *model = ACIO_SIM_ICCC;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* when the scripted key state of each node last changed, for the
+   keypress to report latency, and how many keys went down in total */
+static uint64_t sim_key_changed_us[ACIO_SIM_MAX_NODES];
+static uint32_t sim_key_presses[ACIO_SIM_MAX_NODES];
+
+static void sim_set_keys(ACIOSim *sim, int index, uint16_t key_state, uint64_t now)
+{
+    if (sim->node(index)->key_state != key_state) {
+        sim_key_changed_us[index] = now;
+    }
+    sim_key_presses[index] += __builtin_popcount(key_state & ~sim->node(index)->key_state);
+    sim->set_keys(index, key_state);
+}
+
+static void sim_drain_capture(FILE *f)
+{
+    uint8_t buf[512];
+    int n;
+
+    while (f != NULL && (n = capture_read(buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, f);
+    }
+}
+
+/* stands in for the pico's USB servicing, also from the HAL idle hook
+   while a bring-up blocks: drains the capture and tracks the longest the
+   host would have gone unserved */
+static FILE *sim_capture;
+static uint64_t sim_service_last_us;
+static uint64_t sim_service_gap_max_us;
+
+static void sim_service_host()
+{
+    uint64_t now = hal_time_us();
+
+    if (now - sim_service_last_us > sim_service_gap_max_us) {
+        sim_service_gap_max_us = now - sim_service_last_us;
+    }
+    sim_service_last_us = now;
+    sim_drain_capture(sim_capture);
+}
+
+/* --held-pin: the card on every reader for the whole run, a long PIN
+   typed over it */
+static void sim_script_held_pin(ACIOSim *sim, uint64_t start, uint64_t now)
+{
+    for (int i = 0; i < sim->node_count(); i++) {
+        struct acio_sim_node *n = sim->node(i);
+        uint64_t t = now - start;
+        uint64_t placed = 500000 + (uint64_t)i * 250000;
+        uint64_t offset = SIM_HELD_PIN_START_US + (uint64_t)i * 100000;
+
+        if (t >= placed && n->card_pos == ACIO_SIM_CARD_NONE && n->commands > 0 &&
+            t < offset) {
+            uint8_t uid[8];
+            memcpy(uid, sim_uid, 8);
+            uid[7] += i;
+            sim->place_card(i, uid, n->model == ACIO_SIM_ICCA ? AC_IO_ICCx_CARD_TYPE_ISO15696
+                                                              : AC_IO_ICCx_CARD_TYPE_FELICA);
+        }
+        if (t >= offset && t < offset + SIM_HELD_PIN_KEYS * 200000) {
+            int digit = (t - offset) / 200000;
+            bool down = (t - offset) % 200000 < 100000;
+            sim_set_keys(sim, i, down ? sim_pin[digit % 4] : 0, now);
+        } else if (t >= offset) {
+            sim_set_keys(sim, i, 0, now);
+        }
+    }
+}
+
+/* scripted user actions, staggered per node */
+static void sim_script(ACIOSim *sim, uint64_t start, uint64_t now)
+{
+    static bool desynced[ACIO_SIM_MAX_NODES];
+    static bool unreadable[ACIO_SIM_MAX_NODES];
+    static bool tapped[ACIO_SIM_MAX_NODES];
+    static bool blip_off, blip_done;
+    uint64_t run = now - start;
+
+    if (!blip_off && !blip_done && run >= SIM_BLIP_US) {
+        printf("%6lu ms power off\n", (unsigned long)(run / 1000));
+        sim->set_powered(false);
+        blip_off = true;
+    }
+    if (blip_off && run >= SIM_BLIP_US + SIM_BLIP_LENGTH_US) {
+        printf("%6lu ms power on\n", (unsigned long)(run / 1000));
+        sim->set_powered(true);
+        blip_off = false;
+        blip_done = true;
+    }
+
+    for (int i = 0; i < sim->node_count(); i++) {
+        struct acio_sim_node *n = sim->node(i);
+        uint64_t t = now - start;
+        uint64_t offset = 500000 + i * 250000;
+        bool icca = n->model == ACIO_SIM_ICCA;
+
+        if (t >= offset && n->card_pos == ACIO_SIM_CARD_NONE && n->commands > 0 &&
+            t < offset + 1000000) {
+            uint8_t uid[8];
+            memcpy(uid, sim_uid, 8);
+            uid[7] += i;
+            sim->place_card(i, uid, icca ? AC_IO_ICCx_CARD_TYPE_ISO15696 : AC_IO_ICCx_CARD_TYPE_FELICA);
+        }
+        /* a PIN with the card on the reader, 100ms per key and between keys */
+        if (t >= offset + 600000 && t < offset + 1400000) {
+            int digit = (t - offset - 600000) / 200000;
+            bool down = (t - offset - 600000) % 200000 < 100000;
+            sim_set_keys(sim, i, down ? sim_pin[digit] : 0, now);
+        }
+        if (t >= offset + 1500000 && t < offset + 1600000) {
+            /* a locked ICCA card needs an eject first */
+            if (icca) {
+                sim_set_keys(sim, i, ICCx_KEYPAD_MASK_EMPTY, now);
+            }
+            sim->remove_card(i);
+        }
+        if (t >= offset + 1700000 && t < offset + 1800000) {
+            sim_set_keys(sim, i, ICCx_KEYPAD_MASK_1, now);
+        }
+        if (t >= offset + 1900000 && t < offset + 2000000) {
+            sim_set_keys(sim, i, 0, now);
+            sim->remove_card(i);
+        }
+        /* down and up again before the next poll, only the reader's key
+           events tell it happened */
+        if (t >= offset + 2200000 && !tapped[i]) {
+            sim_set_keys(sim, i, ICCx_KEYPAD_MASK_3, now);
+            sim_set_keys(sim, i, 0, now);
+            tapped[i] = true;
+        }
+        if (!icca && t >= offset + 2500000 && !desynced[i]) {
+            sim->desync_keystream(i, 3);
+            desynced[i] = true;
+        }
+        /* wavepass readers: the card again, lifted for 100ms halfway */
+        if (!icca && ((t >= offset + 3200000 && t < offset + 3500000) ||
+                      (t >= offset + 3600000 && t < offset + 3900000)) &&
+            n->card_pos == ACIO_SIM_CARD_NONE) {
+            uint8_t uid[8];
+            memcpy(uid, sim_uid, 8);
+            uid[7] += i;
+            sim->place_card(i, uid, AC_IO_ICCx_CARD_TYPE_FELICA);
+        }
+        if (!icca && ((t >= offset + 3500000 && t < offset + 3600000) || t >= offset + 3900000)) {
+            sim->remove_card(i);
+        }
+        if (icca && t >= offset + 2500000 && !unreadable[i]) {
+            sim->place_card(i, sim_uid, AC_IO_ICCx_CARD_TYPE_FELICA);
+            unreadable[i] = true;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ACIOSim sim;
+    FILE *capture = NULL;
+    bool held_pin = false;
+
+    for (int i = 1; i < argc; i++) {
+        enum acio_sim_model model;
+        if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture = fopen(argv[++i], "wb");
+            if (capture == NULL) {
+                fprintf(stderr, "can't write %s\n", argv[i]);
+                return 2;
+            }
+            capture_set_enabled(true);
+            continue;
+        }
+        if (strcmp(argv[i], "--held-pin") == 0) {
+            held_pin = true;
+            continue;
+        }
+        if (!sim_parse_model(argv[i], &model)) {
+            fprintf(stderr, "unknown reader model %s\n", argv[i]);
+            return 2;
+        }
+        sim.add_node(model);
+    }
+    if (sim.node_count() == 0) {
+        sim.add_node(ACIO_SIM_ICCB);
+        sim.add_node(ACIO_SIM_ICCC);
+    }
+
+    hal_host_reset();
+    hal_host_attach(&sim);
+    hal_uart_init(ACIO_DEFAULT_BAUDRATE);
+
+    /* the link supervisor brings the bus up, each reader with the
+       profile of its simulated product code, like on the pico */
+    sim_capture = capture;
+    link_init();
+    hal_set_idle_hook(sim_service_host);
+    while (!link_service() && hal_time_us() < SIM_BRINGUP_US) {
+        hal_idle();
+    }
+    sim_service_host();
+    printf("ACIO link %s at %lu baud, %d nodes, readers ready at %lu ms\n",
+           link_is_up() ? "up" : "down", (unsigned long)acio_get_baudrate(), acio_get_node_count(),
+           (unsigned long)(hal_time_us() / 1000));
+    if (!link_is_up()) {
+        return 1;
+    }
+    sim_service_gap_max_us = 0;
+
+    card_cache_init(SIM_CARD_HOLDOFF_US);
+    uint64_t start = hal_time_us();
+    uint32_t scans[ICCX_MAX_NODES] = {0};
+    uint32_t errors[ICCX_MAX_NODES] = {0};
+    uint8_t last_type[ICCX_MAX_NODES] = {0};
+    uint16_t last_keys[ICCX_MAX_NODES] = {0};
+    uint32_t card_inserts[ICCX_MAX_NODES] = {0};
+    uint32_t key_reports[ICCX_MAX_NODES] = {0};
+    uint64_t key_latency_total[ICCX_MAX_NODES] = {0};
+    uint64_t key_latency_max[ICCX_MAX_NODES] = {0};
+    uint32_t key_press_edges[ICCX_MAX_NODES] = {0};
+    uint32_t key_release_edges[ICCX_MAX_NODES] = {0};
+
+    while (hal_time_us() - start < SIM_RUN_US) {
+        if (held_pin) {
+            sim_script_held_pin(&sim, start, hal_time_us());
+        } else {
+            sim_script(&sim, start, hal_time_us());
+        }
+        sim_service_host();
+
+        bool was_up = link_is_up();
+        if (!link_service()) {
+            hal_idle();
+            continue;
+        }
+        if (!was_up) {
+            printf("%6lu ms link up again\n", (unsigned long)((hal_time_us() - start) / 1000));
+        }
+
+        iccx_scan_result_t scan;
+        iccx_scan_status_t status = iccx_service(&scan);
+        link_report(status, scan.node_id);
+        if (!link_is_up()) {
+            printf("%6lu ms link lost\n", (unsigned long)((hal_time_us() - start) / 1000));
+        }
+
+        iccx_key_edge_t edge;
+        while (iccx_pop_key_edge(&edge)) {
+            if (edge.pressed) {
+                key_press_edges[edge.node_id]++;
+            } else {
+                key_release_edges[edge.node_id]++;
+            }
+        }
+
+        if (status == ICCX_SCAN_IDLE) {
+            hal_idle();
+            continue;
+        }
+        if (status == ICCX_SCAN_ERROR) {
+            errors[scan.node_id]++;
+            continue;
+        }
+        if (status != ICCX_SCAN_DONE) {
+            continue;
+        }
+
+        uint8_t id = scan.node_id;
+        unsigned long t = (unsigned long)((hal_time_us() - start) / 1000);
+        scans[id]++;
+
+        if (sim.node(id)->model == ACIO_SIM_ICCA && (scan.key_state & ICCx_KEYPAD_MASK_EMPTY)) {
+            iccx_eject_card(id, AC_IO_ICCA_SLOT_STATE_OPEN);
+        }
+        if (scan.type != last_type[id]) {
+            printf("%6lu ms node %d: ", t, id);
+            if (scan.type == 0) {
+                printf("card removed\n");
+            } else {
+                printf("%s card", scan.type == 1 ? "ISO15693" : "FeliCa");
+                for (int i = 0; i < 8; i++) {
+                    printf(" %02X", scan.uid[i]);
+                }
+                printf("\n");
+            }
+            last_type[id] = scan.type;
+        }
+        /* what the pico would send to the host as a cardio report */
+        if (card_cache_update(id, scan.type, scan.uid, hal_time_us()) == CARD_CACHE_INSERTED) {
+            printf("%6lu ms node %d: card reported\n", t, id);
+            card_inserts[id]++;
+        }
+        if (scan.key_state != last_keys[id]) {
+            printf("%6lu ms node %d: keys %04X", t, id, scan.key_state);
+            /* reported what the script last set: that's the keypress latency */
+            if (scan.key_state == sim.node(id)->key_state) {
+                uint64_t latency = hal_time_us() - sim_key_changed_us[id];
+                printf(" (+%lu ms)", (unsigned long)(latency / 1000));
+                key_reports[id]++;
+                key_latency_total[id] += latency;
+                if (latency > key_latency_max[id]) {
+                    key_latency_max[id] = latency;
+                }
+            }
+            printf("\n");
+            last_keys[id] = scan.key_state;
+        }
+    }
+
+    struct acio_stats stats;
+    acio_get_stats(&stats);
+    printf("acio: %lu transactions, %lu retries, %lu timeouts, %lu checksum, %lu framing, max latency %lu us\n",
+           (unsigned long)stats.transactions, (unsigned long)stats.retries,
+           (unsigned long)stats.timeouts, (unsigned long)stats.checksum_errors,
+           (unsigned long)stats.framing_errors, (unsigned long)stats.max_latency_us);
+
+    struct hal_uart_stats uart;
+    hal_uart_get_stats(&uart);
+    printf("uart: %lu bytes received, %lu dropped\n", (unsigned long)uart.rx_bytes,
+           (unsigned long)uart.rx_dropped);
+
+    struct link_stats link;
+    link_get_stats(&link);
+    printf("link: %lu losses, %lu bring-ups (%lu failed), recovery last %lu us, max %lu us, "
+           "host unserved for up to %lu us\n",
+           (unsigned long)link.losses, (unsigned long)link.attempts, (unsigned long)link.failures,
+           (unsigned long)link.last_recovery_us, (unsigned long)link.max_recovery_us,
+           (unsigned long)sim_service_gap_max_us);
+
+    bool ok = link_is_up() && link.losses == (held_pin ? 0 : 1) && uart.rx_dropped == 0;
+    for (int i = 0; i < sim.node_count(); i++) {
+        struct acio_sim_node *n = sim.node(i);
+        printf("node %d %.4s: %lu scans (%.1f/s), %lu errors, %lu slot commands, %lu ejects, %lu early polls\n",
+               i, n->product, (unsigned long)scans[i], scans[i] * 1e6 / SIM_RUN_US,
+               (unsigned long)errors[i], (unsigned long)n->slot_commands,
+               (unsigned long)n->ejects, (unsigned long)n->early_polls);
+        if (key_reports[i] > 0) {
+            printf("node %d %.4s: %lu key changes, latency avg %lu us, max %lu us\n", i, n->product,
+                   (unsigned long)key_reports[i], (unsigned long)(key_latency_total[i] / key_reports[i]),
+                   (unsigned long)key_latency_max[i]);
+        }
+        struct iccx_stats iccx;
+        iccx_get_stats(i, &iccx);
+        printf("node %d %.4s: %lu key presses, %lu press and %lu release edges, %lu events lost, %lu edges dropped\n",
+               i, n->product, (unsigned long)sim_key_presses[i], (unsigned long)key_press_edges[i],
+               (unsigned long)key_release_edges[i], (unsigned long)iccx.key_events_lost,
+               (unsigned long)iccx.key_edges_dropped);
+        if (key_press_edges[i] != sim_key_presses[i] || key_release_edges[i] != key_press_edges[i]) {
+            printf("node %d lost key edges\n", i);
+            ok = false;
+        }
+        if (n->model != ACIO_SIM_ICCA) {
+            printf("node %d %.4s: %lu crc errors, %lu resyncs (%lu failed), recovery last %lu us, max %lu us, "
+                   "poll gap %lu us\n",
+                   i, n->product, (unsigned long)iccx.crc_errors, (unsigned long)iccx.resyncs,
+                   (unsigned long)iccx.resync_failures, (unsigned long)iccx.last_recovery_us,
+                   (unsigned long)iccx.max_recovery_us, (unsigned long)iccx.poll_gap_us);
+        }
+        /* the wavepass readers see their card twice, the lift in between doesn't count */
+        uint32_t presentations = n->model == ACIO_SIM_ICCA || held_pin ? 1 : 2;
+        if (card_inserts[i] != presentations) {
+            printf("node %d reported its card %lu times, expected %lu\n", i,
+                   (unsigned long)card_inserts[i], (unsigned long)presentations);
+            ok = false;
+        }
+        if (!held_pin && n->model == ACIO_SIM_ICCA && n->card_pos == ACIO_SIM_CARD_INSERTED) {
+            printf("node %d kept an unreadable card\n", i);
+            ok = false;
+        }
+    }
+
+    if (capture != NULL) {
+        sim_drain_capture(capture);
+        fclose(capture);
+        if (capture_get_dropped() > 0) {
+            printf("capture lost %lu records\n", (unsigned long)capture_get_dropped());
+        }
+    }
+
+    return ok ? 0 : 1;
+}
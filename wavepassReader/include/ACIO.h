@@ -1,11 +1,21 @@
-#include "pico/stdlib.h"
-
 #ifndef acio_h
 #define acio_h
 
+#include <stdint.h>
+#include <stddef.h>
+
 #define ac_io_u16(x) __builtin_bswap16(x)
 #define ac_io_u32(x) __builtin_bswap32(x)
 
+/* how long a node may take to become ready for each bring-up step */
+#define ACIO_BRINGUP_TIMEOUT_US 2000000
+
+/* link rate used until acio_open() negotiated a faster one */
+#define ACIO_DEFAULT_BAUDRATE 57600
+
+/* nodes brought up, any further ones on the bus are left alone */
+#define ACIO_MAX_NODES 16
+
 #define AC_IO_SOF 0xAA
 #define AC_IO_ESCAPE 0xFF
 enum ac_io_cmd {
@@ -18,7 +28,8 @@ enum ac_io_cmd {
     AC_IO_CMD_CLEAR = 0x0100,
 };
 
-struct ac_io_version {
+/* both structs mirror the wire layout, so they must not be padded */
+struct __attribute__((packed)) ac_io_version {
     /* Names taken from some debug text in libacio.dll */
     uint32_t type;
     uint8_t flag;
@@ -30,7 +41,7 @@ struct ac_io_version {
     char time[16];
 };
 
-struct ac_io_message {
+struct __attribute__((packed)) ac_io_message {
     uint8_t addr; /* High bit: clear = req, set = resp */
 
     union {
@@ -54,10 +65,102 @@ struct ac_io_message {
     };
 };
 
+/* maximum number of requests in flight at once */
+#define ACIO_QUEUE_SIZE 8
+
+enum acio_transaction_state {
+    ACIO_TRANSACTION_IDLE,
+    ACIO_TRANSACTION_QUEUED, /* waiting to be sent */
+    ACIO_TRANSACTION_SENT,   /* waiting for the response */
+    ACIO_TRANSACTION_DONE,
+    ACIO_TRANSACTION_FAILED,
+};
+
+enum acio_error {
+    ACIO_OK,
+    ACIO_ERR_TIMEOUT,       /* no (complete) answer before the deadline */
+    ACIO_ERR_CHECKSUM,
+    ACIO_ERR_FRAMING,       /* bytes lost, decoder resynced */
+    ACIO_ERR_CODE_MISMATCH, /* answer to our seq_no but for another command */
+    ACIO_ERR_SHORT,         /* answer with less payload than the command needs */
+    ACIO_ERR_SEND,
+    ACIO_ERR_QUEUE_FULL,
+};
+
+enum acio_retry_mode {
+    ACIO_RETRY_NONE,      /* give up on the first error */
+    ACIO_RETRY_IMMEDIATE, /* resend right away with the same seq_no */
+    ACIO_RETRY_BACKOFF,   /* resend with the same seq_no after a doubling delay */
+};
+
+struct acio_retry_policy {
+    enum acio_retry_mode mode;
+    uint8_t attempts;    /* total attempts, including the first one */
+    uint32_t timeout_us; /* deadline for each attempt, from the time it was sent */
+    uint32_t backoff_us; /* delay before the first resend in backoff mode */
+};
+
+/* used for every command without a policy of its own */
+extern const struct acio_retry_policy acio_default_policy;
+
+struct acio_stats {
+    uint32_t transactions;
+    uint32_t retries;
+    uint32_t timeouts;
+    uint32_t checksum_errors;
+    uint32_t framing_errors;
+    uint32_t code_mismatches;
+    uint32_t short_responses;
+    uint32_t max_latency_us; /* submit to completion, retries included */
+};
+
+struct acio_transaction;
+typedef void (*acio_callback_t)(struct acio_transaction *txn);
+
+/* A request/response pair. msg holds the request and is overwritten
+   with the response, matched on cmd.seq_no and cmd.code. A response
+   with fewer than resp_nbytes of payload fails instead, so msg never
+   holds less than the caller reads from it. The caller owns both and
+   must keep them alive until the transaction finished. */
+struct acio_transaction {
+    struct ac_io_message *msg;
+    uint8_t resp_nbytes;
+    acio_callback_t callback; /* optional, called once finished */
+    void *ctx;
+    /* NULL picks the policy registered for the command */
+    const struct acio_retry_policy *policy;
+    enum acio_transaction_state state;
+    enum acio_error error;
+    uint16_t code;
+    uint8_t seq_no;
+    uint8_t attempt;
+    uint32_t send_order;
+    uint64_t not_before; /* earliest time for the next attempt */
+    uint64_t deadline;   /* hal_time_us() by which the answer must be complete */
+    uint64_t submitted;
+};
+
 int acio_get_counter_and_increase();
+void acio_transaction_init(struct acio_transaction *txn, struct ac_io_message *msg,
+                           uint8_t resp_nbytes, acio_callback_t callback, void *ctx);
+bool acio_submit(struct acio_transaction *txn);
+bool acio_flush();
+void acio_poll();
+bool acio_wait(struct acio_transaction *txn);
+void acio_set_retry_policy(uint16_t code, const struct acio_retry_policy *policy);
+uint64_t acio_retry_policy_worst_case_us(const struct acio_retry_policy *policy);
+enum acio_error acio_get_last_error();
+void acio_get_stats(struct acio_stats *stats);
 bool acio_send(const uint8_t *buffer, int length);
-int acio_receive(uint8_t *buffer, int size);
-bool acio_send_and_recv(struct ac_io_message *msg, int resp_size);
+int acio_receive(struct ac_io_message *msg);
+bool acio_send_and_recv(struct ac_io_message *msg, uint8_t resp_nbytes);
+/* false once deadline passed, otherwise waits a little before the next try */
+bool acio_bringup_retry(uint64_t deadline);
 bool acio_open();
+uint8_t acio_get_node_count();
+/* the 4 character product code from GET_VERSION (not terminated), NULL if
+   there is no such node */
+const char *acio_get_node_product(uint8_t node_id);
+uint32_t acio_get_baudrate();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef acio_frame_h
+#define acio_frame_h
+
+#include "ACIO.h"
+
+/* Wire framing for ACIO messages, independent from the pico-sdk.
+
+   A frame on the wire is SOF, then addr, code (2), seq_no, nbytes,
+   nbytes of payload and a checksum (sum of all previous bytes). Every
+   byte after the SOF equal to SOF or ESCAPE is sent as ESCAPE, ~byte. */
+
+/* largest unescaped frame: header plus a full payload */
+#define ACIO_FRAME_MAX_SIZE (offsetof(struct ac_io_message, cmd.raw) + 0xFF)
+
+/* worst case wire size for an unescaped frame of n bytes:
+   SOF, then every byte and the checksum escaped */
+#define ACIO_FRAME_MAX_ENCODED_SIZE(n) (1 + 2 * ((n) + 1))
+
+/* receives the encoded frame piece by piece, returns false to abort */
+typedef bool (*acio_frame_sink_t)(const uint8_t *data, int length, void *ctx);
+
+/* escaped bytes handed to the sink at a time, a FEL_POLL frame fits in one */
+#ifndef ACIO_FRAME_ENCODE_CHUNK
+#define ACIO_FRAME_ENCODE_CHUNK 64
+#endif
+
+/* Stream a frame to sink without building a full escaped copy: it is
+   escaped into an ACIO_FRAME_ENCODE_CHUNK byte scratch on the stack and
+   handed over a chunk at a time. Returns the number of wire bytes
+   emitted, or -1 if length is out of range or the sink failed. */
+int acio_frame_encode(const uint8_t *buffer, int length, acio_frame_sink_t sink, void *ctx);
+
+enum acio_decode_status {
+    ACIO_DECODE_PENDING,        /* all input consumed, frame not complete yet */
+    ACIO_DECODE_FRAME,          /* a valid frame has been written to the message */
+    ACIO_DECODE_CHECKSUM_ERROR, /* frame complete but checksum mismatch */
+    ACIO_DECODE_FRAMING_ERROR,  /* unexpected SOF or bad escape, resynced */
+};
+
+/* Push-style decoder, accepts input in chunks of any size and writes the
+   unescaped frame straight into the target ac_io_message. */
+class ACIODecoder
+{
+public:
+    ACIODecoder();
+
+    /* start decoding a new frame into msg, drops any partial frame
+       but keeps a SOF seen during resync */
+    void begin(struct ac_io_message *msg);
+
+    /* consume input until a frame completes, an error is detected or the
+       input runs out. consumed is set to the number of bytes used, the
+       remaining bytes belong to the next frame. */
+    acio_decode_status push(const uint8_t *data, int length, int *consumed);
+
+    /* drop everything, including a SOF seen during resync */
+    void reset();
+
+    /* true once the SOF of the current frame has been seen */
+    bool in_frame() const;
+
+    /* size of the last decoded frame, checksum excluded */
+    int frame_size() const;
+
+    uint32_t frames;
+    uint32_t checksum_errors;
+    uint32_t framing_errors;
+
+private:
+    enum state {
+        WAIT_SOF,
+        DATA,
+        ESCAPED,
+    };
+
+    uint8_t *target;
+    state st;
+    int pos;
+    int expected;
+    uint8_t checksum;
+};
+
+#endif
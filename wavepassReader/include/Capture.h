@@ -0,0 +1,47 @@
+#ifndef capture_h
+#define capture_h
+
+#include <stdint.h>
+
+/* Binary log of the ACIO traffic, kept in a RAM ring and drained by the
+   main loop (over the EAMUSE CDC port on the pico).
+
+   The stream is a sequence of records, each a capture_record header
+   (little endian) followed by length bytes of the unescaped frame:
+   addr, code, seq_no, nbytes, payload. Records start with CAPTURE_SYNC
+   so a reader joining mid-stream can find the next one. Recording is
+   off until capture_set_enabled(true), so an idle ring costs nothing. */
+
+#define CAPTURE_BUFFER_SIZE 4096
+#define CAPTURE_SYNC 0xC5
+
+enum capture_flags {
+    CAPTURE_DIR_RX = 0x80,      /* set for frames from the bus, clear for ours */
+    CAPTURE_OVERFLOW = 0x40,    /* records were lost right before this one */
+    CAPTURE_STATUS_MASK = 0x0F, /* a capture_status */
+};
+
+enum capture_status {
+    CAPTURE_OK,
+    CAPTURE_CHECKSUM_ERROR, /* frame complete, checksum mismatch */
+    CAPTURE_FRAMING_ERROR,  /* frame cut short, length is 0 */
+    CAPTURE_SEND_ERROR,
+    CAPTURE_DECRYPTED, /* plaintext of the encrypted answer recorded right before */
+};
+
+struct __attribute__((packed)) capture_record {
+    uint8_t sync;
+    uint8_t flags;
+    uint8_t node;    /* addr without the response bit, 0xFF if unknown */
+    uint16_t length; /* frame bytes following the header */
+    uint32_t time_us; /* low 32 bits of hal_time_us(), wraps every ~71 minutes */
+};
+
+void capture_set_enabled(bool enabled);
+bool capture_is_enabled();
+void capture_frame(bool rx, enum capture_status status, const uint8_t *frame, int length);
+/* drain up to size bytes of the stream, records may be split across reads */
+int capture_read(uint8_t *buffer, int size);
+uint32_t capture_get_dropped();
+
+#endif
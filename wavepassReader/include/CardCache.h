@@ -0,0 +1,31 @@
+#ifndef cardcache_h
+#define cardcache_h
+
+#include <stdint.h>
+#include "ACIO.h"
+
+/* Recently seen cards, so each one is reported to the host once per
+   presentation without holding up anything else.
+
+   Every finished scan cycle is fed in with the node it came from. A card
+   is INSERTED when its UID wasn't on that node, REMOVED when the node
+   reads no card any more. A card that comes back within the hold-off of
+   its removal (a read that dropped out for a cycle, or the card lifted
+   and put back right away) is taken as never having left. Other cards
+   are not affected, a different UID is INSERTED straight away. */
+
+/* a card on every node and one just lifted off each, so a card still on
+   its reader is never pushed out */
+#define CARD_CACHE_SIZE (2 * ACIO_MAX_NODES)
+
+enum card_cache_event {
+    CARD_CACHE_NONE,
+    CARD_CACHE_INSERTED, /* a card swapped for another in one cycle only gives this */
+    CARD_CACHE_REMOVED,
+};
+
+void card_cache_init(uint32_t holdoff_us);
+/* type 0 means the node read no card, uid is ignored then */
+enum card_cache_event card_cache_update(uint8_t node_id, uint8_t type, const uint8_t *uid, uint64_t now);
+
+#endif
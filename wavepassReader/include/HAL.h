@@ -0,0 +1,43 @@
+#ifndef hal_h
+#define hal_h
+
+#include <stdint.h>
+
+/* Thin hardware layer for the reader stack.
+   The ACIO/ICCx code only talks to the UART, clock and GPIOs through
+   these calls. On the pico, received bytes are collected by the UART IRQ
+   into a ring and drained in bulk. The host build implements the same
+   calls on a virtual clock and a simulated ACIO bus. */
+
+#define HAL_UART_RX_BUFFER_SIZE 1024
+
+struct hal_uart_stats {
+    uint32_t rx_bytes;    /* bytes moved from the FIFO into the ring */
+    uint32_t rx_dropped;  /* bytes lost because the ring was full */
+    uint32_t rx_overruns; /* bytes lost because the hardware FIFO overflowed */
+    uint32_t rx_irqs;
+};
+
+void hal_uart_init(uint32_t baudrate);
+uint32_t hal_uart_set_baudrate(uint32_t baudrate);
+int hal_uart_available();
+int hal_uart_read(uint8_t *buffer, int size);
+bool hal_uart_write(const uint8_t *buffer, int length);
+void hal_uart_putc(uint8_t value);
+void hal_uart_flush_rx();
+void hal_uart_get_stats(struct hal_uart_stats *stats);
+
+/* microseconds since reset */
+uint64_t hal_time_us();
+void hal_sleep_ms(uint32_t ms);
+void hal_sleep_us(uint64_t us);
+/* called from every busy wait */
+void hal_idle();
+/* run from hal_idle() and the sleeps, to keep USB serviced while the
+   reader stack blocks; it must not use the stack itself. NULL removes it */
+void hal_set_idle_hook(void (*hook)());
+
+void hal_gpio_init_pullup(uint8_t pin);
+bool hal_gpio_get(uint8_t pin);
+
+#endif
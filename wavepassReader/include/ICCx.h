@@ -4,6 +4,9 @@
 
 #define EJECT_DELAY 1000
 
+/* one reader context per enumerated ACIO node */
+#define ICCX_MAX_NODES ACIO_MAX_NODES
+
 enum iccx_cmd {
     AC_IO_CMD_ICCx_QUEUE_LOOP_START = 0x0130,
     AC_IO_CMD_ICCx_ENGAGE = 0x0131,
@@ -85,8 +88,62 @@ typedef struct iccx_key_state_s {
     uint8_t key4;
 } iccx_key_state_t;
 
-bool iccx_init(uint8_t node_id, bool encrypted);
-bool iccx_scan_card(uint8_t *type, uint8_t *uid, uint16_t *key_state, bool encrypted);
-bool iccx_eject_card(icca_slot_state_t post_state);
+typedef enum iccx_scan_status {
+    ICCX_SCAN_IDLE,  /* no node is due yet */
+    ICCX_SCAN_BUSY,  /* a node made progress, its cycle isn't complete yet */
+    ICCX_SCAN_DONE,  /* a node finished a cycle, result is valid */
+    ICCX_SCAN_ERROR, /* a node failed to answer, result.node_id tells which */
+} iccx_scan_status_t;
+
+typedef struct iccx_scan_result_s {
+    uint8_t node_id;
+    uint8_t type;      /* 0 no card, 1 ISO15693, 2 FeliCa */
+    uint8_t uid[8];
+    uint16_t key_state;
+} iccx_scan_result_t;
+
+/* one key going down or up, in the order the reader saw it */
+typedef struct iccx_key_edge_s {
+    uint8_t node_id;
+    bool pressed;
+    uint16_t mask;     /* one of ICCx_KEYPAD_MASK_* */
+} iccx_key_edge_t;
+
+/* what a reader model can do, picked from its GET_VERSION product code */
+typedef struct iccx_profile_s {
+    char product[4];       /* not terminated, "????" for models we don't know */
+    bool encrypted;        /* FEL_ENGAGE/FEL_POLL and FeliCa, plain ENGAGE/POLL otherwise */
+    bool slot;             /* ICCA card slot with shutter and eject */
+    uint32_t min_gap_us;   /* shortest ENGAGE to FEL_POLL wait to probe down to */
+} iccx_profile_t;
+
+/* per node since boot, the CRC, resync and pacing ones for encrypted readers only */
+struct iccx_stats {
+    uint32_t crc_errors;
+    uint32_t resyncs;          /* key exchanges after a run of CRC errors */
+    uint32_t resync_failures;  /* of those, unanswered */
+    uint32_t last_recovery_us; /* first CRC error of a run to the next good poll */
+    uint32_t max_recovery_us;
+    uint32_t poll_gap_us;      /* current ENGAGE to FEL_POLL wait */
+    uint32_t key_events_lost;  /* presses gone from the reader's 2 entry history before we polled */
+    uint32_t key_edges_dropped; /* edge queue full */
+};
+
+/* profile for a product code, unknown newer models get the ICCB/ICCC one */
+const iccx_profile_t *iccx_find_profile(const char *product);
+/* profile NULL: the one for the node's product code */
+bool iccx_init(uint8_t node_id, const iccx_profile_t *profile);
+/* the profile the node runs with, NULL before iccx_init */
+const iccx_profile_t *iccx_get_profile(uint8_t node_id);
+/* stop polling every node, keys still down get their release edge */
+void iccx_close();
+/* scan one node, blocking until its cycle is complete */
+bool iccx_scan_card(uint8_t node_id, uint8_t *type, uint8_t *uid, uint16_t *key_state);
+/* interleave scan cycles over every initialized node, never waits */
+iccx_scan_status_t iccx_service(iccx_scan_result_t *result);
+bool iccx_eject_card(uint8_t node_id, icca_slot_state_t post_state);
+void iccx_get_stats(uint8_t node_id, struct iccx_stats *stats);
+/* oldest key edge not taken yet, false if there is none */
+bool iccx_pop_key_edge(iccx_key_edge_t *edge);
 
 #endif
\ No newline at end of file
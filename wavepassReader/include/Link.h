@@ -0,0 +1,36 @@
+#ifndef link_h
+#define link_h
+
+#include <stdint.h>
+#include "ICCx.h"
+
+/* Supervises the ACIO link: brings the bus and every reader on it up,
+   notices when a reader stops answering (unplugged, power blip, reset)
+   and brings everything up again, backing off exponentially while
+   nothing answers. A bring-up attempt still blocks for up to a few
+   seconds, keep USB serviced from the HAL idle hook meanwhile. */
+
+/* failed scan steps in a row on one node before the link counts as lost */
+#define LINK_LOSS_ERRORS 3
+/* wait after a failed bring-up, doubled on each failure up to the max */
+#define LINK_RETRY_MIN_US 250000
+#define LINK_RETRY_MAX_US 8000000
+
+struct link_stats {
+    uint32_t losses;
+    uint32_t attempts;         /* bring-ups tried, including the first */
+    uint32_t failures;         /* of those, not completed */
+    uint32_t last_recovery_us; /* link lost to link up again */
+    uint32_t max_recovery_us;
+};
+
+/* starts down, the first link_service() brings it up */
+void link_init();
+/* brings the link up if it's down and the retry is due, true while it's up */
+bool link_service();
+bool link_is_up();
+/* feed every iccx_service() result to notice a lost reader */
+void link_report(iccx_scan_status_t status, uint8_t node_id);
+void link_get_stats(struct link_stats *stats);
+
+#endif
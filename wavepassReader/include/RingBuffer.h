@@ -0,0 +1,118 @@
+#ifndef ringbuffer_h
+#define ringbuffer_h
+
+#include <stdint.h>
+#include <string.h>
+
+/* Single producer / single consumer byte ring.
+   The producer (UART IRQ) only ever writes head, the consumer (main loop)
+   only ever writes tail, so no locking is needed on a single core.
+   Indices run freely and are masked on access, N must be a power of two. */
+template <uint16_t N>
+class RingBuffer
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "RingBuffer size must be a power of two");
+
+public:
+    RingBuffer() : head(0), tail(0), dropped(0) {}
+
+    uint16_t available() const
+    {
+        return (uint16_t)(head - tail);
+    }
+
+    uint16_t free() const
+    {
+        return N - available();
+    }
+
+    /* producer side */
+    bool push(uint8_t value)
+    {
+        uint16_t h = head;
+
+        if ((uint16_t)(h - tail) == N)
+        {
+            dropped++;
+            return false;
+        }
+
+        data[h & (N - 1)] = value;
+        /* make the byte visible before publishing the new head */
+        __atomic_signal_fence(__ATOMIC_RELEASE);
+        head = h + 1;
+        return true;
+    }
+
+    /* producer side, all or nothing so a record never gets cut */
+    bool write(const uint8_t *buffer, uint16_t size)
+    {
+        uint16_t h = head;
+
+        if (size > (uint16_t)(N - (uint16_t)(h - tail)))
+        {
+            dropped += size;
+            return false;
+        }
+
+        uint16_t offset = h & (N - 1);
+        uint16_t first = N - offset;
+        if (first > size)
+        {
+            first = size;
+        }
+
+        memcpy(data + offset, buffer, first);
+        memcpy(data, buffer + first, size - first);
+
+        __atomic_signal_fence(__ATOMIC_RELEASE);
+        head = h + size;
+        return true;
+    }
+
+    /* consumer side, drains up to size bytes in at most two copies */
+    int read(uint8_t *buffer, int size)
+    {
+        uint16_t t = tail;
+        uint16_t count = (uint16_t)(head - t);
+        __atomic_signal_fence(__ATOMIC_ACQUIRE);
+
+        if (size < count)
+        {
+            count = size;
+        }
+
+        uint16_t offset = t & (N - 1);
+        uint16_t first = N - offset;
+        if (first > count)
+        {
+            first = count;
+        }
+
+        memcpy(buffer, data + offset, first);
+        memcpy(buffer + first, data, count - first);
+
+        __atomic_signal_fence(__ATOMIC_RELEASE);
+        tail = t + count;
+        return count;
+    }
+
+    /* consumer side, discard everything received so far */
+    void clear()
+    {
+        tail = head;
+    }
+
+    uint32_t dropped_count() const
+    {
+        return dropped;
+    }
+
+private:
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    volatile uint32_t dropped;
+    uint8_t data[N];
+};
+
+#endif
@@ -1,315 +1,626 @@
 #include "ACIO.h"
+#include "ACIOFrame.h"
+#include "Capture.h"
+#include "HAL.h"
 #include <stdio.h>
-#include "pico/stdlib.h"
-#include "hardware/uart.h"
 #include <cstring>
 
 //#define ACIO_DEBUG
 
 static uint8_t acio_msg_counter = 1;
 static uint8_t acio_node_count;
-static char acio_node_products[16][4];
+static char acio_node_products[ACIO_MAX_NODES][4];
+static ACIODecoder acio_decoder;
+
+/* in flight transactions, oldest first */
+static struct acio_transaction *acio_queue[ACIO_QUEUE_SIZE];
+static uint8_t acio_queue_count;
+/* responses are decoded here until we know which request they answer */
+static struct ac_io_message acio_rx_msg;
+static enum acio_error acio_rx_error;
+static enum acio_error acio_last_error;
+static uint32_t acio_send_counter;
+static struct acio_stats acio_stats;
+
+/* give up on the SOF handshake after this long */
+#define ACIO_INIT_TIMEOUT_US 1000000
+/* time spent on each candidate rate while probing */
+#define ACIO_PROBE_TIMEOUT_US 100000
+/* time for the node to echo a single SOF */
+#define ACIO_INIT_ECHO_US 2000
+/* consecutive SOF echoes for a rate to count as clean */
+#define ACIO_INIT_CLEAN_ECHOES 4
+#define ACIO_INIT_SETTLE_MS 5
+
+/* pause between attempts of a bring-up step the node wasn't ready for */
+#define ACIO_BRINGUP_RETRY_MS 10
+
+/* standard ACIO rates, probed fastest first */
+static const uint32_t acio_baudrates[] = {115200, 57600, 38400};
+static uint32_t acio_baudrate = ACIO_DEFAULT_BAUDRATE;
+
+const struct acio_retry_policy acio_default_policy = {
+    ACIO_RETRY_IMMEDIATE, 3, 100000, 0,
+};
+
+#define ACIO_POLICY_SLOTS 8
+static struct {
+    uint16_t code;
+    const struct acio_retry_policy *policy;
+} acio_policies[ACIO_POLICY_SLOTS];
+
+/* streams each piece of the escaped frame straight into the TX FIFO */
+static bool acio_uart_sink(const uint8_t *data, int length, void *ctx)
+{
+    (void)ctx;
+#ifdef ACIO_DEBUG
+    for (int i = 0; i < length; i++)
+    {
+        if (data[i] < 0x10)
+            printf("0");
+        printf("%X", data[i]);
+        printf(" ");
+    }
+#endif
+    return hal_uart_write(data, length);
+}
 
 bool acio_send(const uint8_t *buffer, int length)
 {
-    uint8_t send_buf[512];
-    int send_buf_pos = 0;
-    uint8_t checksum = 0;
+#ifdef ACIO_DEBUG
+    printf("SEND : ");
+#endif
+    int written = acio_frame_encode(buffer, length, acio_uart_sink, NULL);
+    capture_frame(false, written > 0 ? CAPTURE_OK : CAPTURE_SEND_ERROR, buffer, length);
+#ifdef ACIO_DEBUG
+    printf("\n");
+    if (written < 0)
+    {
+        printf("Sending data failed \n");
+    }
+#endif
+
+    return written > 0;
+}
+
+/* bytes drained from the RX ring but not consumed by the decoder yet */
+static uint8_t rx_chunk[64];
+static int rx_chunk_pos;
+static int rx_chunk_len;
+
+int acio_receive(struct ac_io_message *msg)
+{
+    /* only retarget the decoder between frames */
+    if (!acio_decoder.in_frame() || acio_decoder.frame_size() == 0)
+    {
+        acio_decoder.begin(msg);
+    }
 
-    if (length > sizeof(send_buf))
+    while (true)
     {
+        if (rx_chunk_pos == rx_chunk_len)
+        {
+            rx_chunk_pos = 0;
+            rx_chunk_len = hal_uart_read(rx_chunk, sizeof(rx_chunk));
+
+            if (rx_chunk_len == 0)
+            {
+                return 0;
+            }
+        }
+
+        int consumed;
+        acio_decode_status status = acio_decoder.push(
+            rx_chunk + rx_chunk_pos, rx_chunk_len - rx_chunk_pos, &consumed);
+        rx_chunk_pos += consumed;
+
+        switch (status)
+        {
+        case ACIO_DECODE_PENDING:
+            break;
+
+        case ACIO_DECODE_FRAME:
 #ifdef ACIO_DEBUG
-        printf("Send buffer overflow \n");
+            printf("RECV : ");
+            for (int i = 0; i < acio_decoder.frame_size(); i++)
+            {
+                if (((uint8_t *)msg)[i] < 0x10)
+                    printf("0");
+                printf("%X", ((uint8_t *)msg)[i]);
+                printf(" ");
+            }
+            printf("\n");
 #endif
-        return false;
+            capture_frame(true, CAPTURE_OK, (const uint8_t *)msg, acio_decoder.frame_size());
+            return acio_decoder.frame_size(); // checksum doesn't count
+
+        case ACIO_DECODE_CHECKSUM_ERROR:
+#ifdef ACIO_DEBUG
+            printf("Invalid message checksum \n");
+#endif
+            capture_frame(true, CAPTURE_CHECKSUM_ERROR, (const uint8_t *)msg, acio_decoder.frame_size());
+            acio_rx_error = ACIO_ERR_CHECKSUM;
+            return -1;
+
+        case ACIO_DECODE_FRAMING_ERROR:
+#ifdef ACIO_DEBUG
+            printf("Framing error, resynced on SOF \n");
+#endif
+            capture_frame(true, CAPTURE_FRAMING_ERROR, NULL, 0);
+            acio_rx_error = ACIO_ERR_FRAMING;
+            return -1;
+        }
     }
+}
 
-    send_buf[send_buf_pos++] = AC_IO_SOF;
+/* forget anything received so far, including a partial frame */
+static void acio_reset_rx()
+{
+    hal_uart_flush_rx();
+    rx_chunk_pos = 0;
+    rx_chunk_len = 0;
+    acio_decoder.reset();
+}
 
-    for (int i = 0; i < length; i++)
+int acio_get_counter_and_increase()
+{
+    return acio_msg_counter++;
+}
+
+void acio_set_retry_policy(uint16_t code, const struct acio_retry_policy *policy)
+{
+    uint8_t free_slot = ACIO_POLICY_SLOTS;
+
+    for (uint8_t i = 0; i < ACIO_POLICY_SLOTS; i++)
     {
-        if (buffer[i] == AC_IO_SOF || buffer[i] == AC_IO_ESCAPE)
+        if (acio_policies[i].policy != NULL && acio_policies[i].code == code)
         {
-            send_buf[send_buf_pos++] = AC_IO_ESCAPE;
-            send_buf[send_buf_pos++] = ~buffer[i];
+            acio_policies[i].policy = policy;
+            return;
         }
-        else
+
+        if (acio_policies[i].policy == NULL && free_slot == ACIO_POLICY_SLOTS)
+        {
+            free_slot = i;
+        }
+    }
+
+    if (free_slot != ACIO_POLICY_SLOTS)
+    {
+        acio_policies[free_slot].code = code;
+        acio_policies[free_slot].policy = policy;
+    }
+}
+
+static const struct acio_retry_policy *acio_get_retry_policy(uint16_t code)
+{
+    for (uint8_t i = 0; i < ACIO_POLICY_SLOTS; i++)
+    {
+        if (acio_policies[i].policy != NULL && acio_policies[i].code == code)
         {
-            send_buf[send_buf_pos++] = buffer[i];
+            return acio_policies[i].policy;
         }
+    }
+
+    return &acio_default_policy;
+}
+
+uint64_t acio_retry_policy_worst_case_us(const struct acio_retry_policy *policy)
+{
+    uint64_t total = 0;
+    uint32_t backoff = policy->backoff_us;
+    uint8_t attempts = policy->mode == ACIO_RETRY_NONE ? 1 : policy->attempts;
+
+    for (uint8_t i = 0; i < attempts; i++)
+    {
+        total += policy->timeout_us;
+
+        if (i + 1 < attempts && policy->mode == ACIO_RETRY_BACKOFF)
+        {
+            total += backoff;
+            backoff *= 2;
+        }
+    }
+
+    return total;
+}
+
+void acio_transaction_init(struct acio_transaction *txn, struct ac_io_message *msg,
+                           uint8_t resp_nbytes, acio_callback_t callback, void *ctx)
+{
+    txn->msg = msg;
+    txn->resp_nbytes = resp_nbytes;
+    txn->callback = callback;
+    txn->ctx = ctx;
+    txn->policy = NULL;
+    txn->state = ACIO_TRANSACTION_IDLE;
+    txn->error = ACIO_OK;
+    txn->code = 0;
+    txn->seq_no = 0;
+    txn->attempt = 0;
+    txn->send_order = 0;
+    txn->not_before = 0;
+    txn->deadline = 0;
+    txn->submitted = 0;
+}
+
+static void acio_complete(struct acio_transaction *txn, enum acio_error error)
+{
+    uint64_t now = hal_time_us();
 
-        checksum += buffer[i];
+    txn->state = error == ACIO_OK ? ACIO_TRANSACTION_DONE : ACIO_TRANSACTION_FAILED;
+    txn->error = error;
+
+    if (now - txn->submitted > acio_stats.max_latency_us)
+    {
+        acio_stats.max_latency_us = now - txn->submitted;
     }
 
-    if (checksum == AC_IO_SOF || checksum == AC_IO_ESCAPE)
+    if (txn->callback != NULL)
     {
-        send_buf[send_buf_pos++] = AC_IO_ESCAPE;
-        send_buf[send_buf_pos++] = ~checksum;
+        txn->callback(txn);
     }
-    else
+}
+
+/* apply the retry policy to a failed attempt */
+static void acio_fail(struct acio_transaction *txn, enum acio_error error)
+{
+    const struct acio_retry_policy *policy = txn->policy;
+
+    switch (error)
     {
-        send_buf[send_buf_pos++] = checksum;
+    case ACIO_ERR_TIMEOUT:
+        acio_stats.timeouts++;
+        break;
+    case ACIO_ERR_CHECKSUM:
+        acio_stats.checksum_errors++;
+        break;
+    case ACIO_ERR_FRAMING:
+        acio_stats.framing_errors++;
+        break;
+    case ACIO_ERR_CODE_MISMATCH:
+        acio_stats.code_mismatches++;
+        break;
+    case ACIO_ERR_SHORT:
+        acio_stats.short_responses++;
+        break;
+    default:
+        break;
     }
-#ifdef ACIO_DEBUG
-    printf("SEND : ");
-    for (int i = 0; i < send_buf_pos; i++)
+
+    if (policy->mode == ACIO_RETRY_NONE || txn->attempt >= policy->attempts)
     {
-        if (send_buf[i] < 0x10)
-            printf("0");
-        printf("%X", send_buf[i]);
-        printf(" ");
+        acio_complete(txn, error);
+        return;
     }
+
+#ifdef ACIO_DEBUG
+    printf("Retrying seq ");
+    printf("%X", txn->seq_no);
+    printf(" after error ");
+    printf("%d", error);
     printf("\n");
 #endif
+    acio_stats.retries++;
+    txn->error = error;
+    /* resend with the same seq_no, a late answer to the first try still matches */
+    txn->state = ACIO_TRANSACTION_QUEUED;
+    txn->not_before = hal_time_us();
 
-    if (!uart_is_writable(uart1))
+    if (policy->mode == ACIO_RETRY_BACKOFF)
     {
+        txn->not_before += (uint64_t)policy->backoff_us << (txn->attempt - 1);
+    }
+}
+
+/* drop finished transactions, keeping the order of the rest */
+static void acio_queue_compact()
+{
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < acio_queue_count; i++)
+    {
+        if (acio_queue[i]->state == ACIO_TRANSACTION_QUEUED ||
+            acio_queue[i]->state == ACIO_TRANSACTION_SENT)
+        {
+            acio_queue[count++] = acio_queue[i];
+        }
+    }
+
+    acio_queue_count = count;
+}
+
+bool acio_submit(struct acio_transaction *txn)
+{
+    if (acio_queue_count == ACIO_QUEUE_SIZE)
+    {
+#ifdef ACIO_DEBUG
+        printf("Transaction queue full \n");
+#endif
+        txn->state = ACIO_TRANSACTION_FAILED;
+        txn->error = ACIO_ERR_QUEUE_FULL;
         return false;
     }
 
-    uart_write_blocking(uart1, send_buf, send_buf_pos);
-//     size_t written = 
-//     if (Serial1.write(send_buf, send_buf_pos) != send_buf_pos)
-//     {
-// #ifdef ACIO_DEBUG
-//         printfln("Sending data failed");
-// #endif
-//         return false;
-//     }
+    if (txn->policy == NULL)
+    {
+        txn->policy = acio_get_retry_policy(txn->msg->cmd.code);
+    }
 
+    txn->msg->cmd.seq_no = acio_msg_counter++;
+    /* remember the sent cmd for matching, msg is overwritten by the response */
+    txn->code = txn->msg->cmd.code;
+    txn->seq_no = txn->msg->cmd.seq_no;
+    txn->state = ACIO_TRANSACTION_QUEUED;
+    txn->error = ACIO_OK;
+    txn->attempt = 0;
+    txn->submitted = hal_time_us();
+    txn->not_before = txn->submitted;
+
+    acio_queue[acio_queue_count++] = txn;
+    acio_stats.transactions++;
     return true;
 }
 
-int acio_receive(uint8_t *buffer, int size)
+bool acio_flush()
 {
-    uint8_t recv_buf[512];
-    int recv_size = 0;
-    int read = 0;
-    uint8_t checksum = 0;
-    int result_size = 0;
-    /* reading a byte stream, we are getting a varying amount
-       of 0xAAs before we get a valid message. */
-    recv_buf[0] = AC_IO_SOF;
-    
-    int retry = 0;
+    bool success = true;
+    uint64_t now = hal_time_us();
 
-    do {
+    /* everything due goes out back to back in one burst */
+    for (uint8_t i = 0; i < acio_queue_count; i++)
+    {
+        struct acio_transaction *txn = acio_queue[i];
 
-        if (retry == 3) {
-            return -1;
+        if (txn->state != ACIO_TRANSACTION_QUEUED || now < txn->not_before)
+        {
+            continue;
         }
 
-        if (!uart_is_readable(uart1))
+        int send_size = offsetof(struct ac_io_message, cmd.raw) + txn->msg->cmd.nbytes;
+
+        txn->attempt++;
+        if (acio_send((uint8_t *)txn->msg, send_size))
         {
-            retry++;
-            continue;
+            txn->state = ACIO_TRANSACTION_SENT;
+            txn->send_order = acio_send_counter++;
+            txn->deadline = hal_time_us() + txn->policy->timeout_us;
+        }
+        else
+        {
+            acio_fail(txn, ACIO_ERR_SEND);
+            success = false;
         }
+    }
 
-        // Read a single byte from the UART
-        uart_read_blocking(uart1, recv_buf, 1);
-    } while (recv_buf[0] == AC_IO_SOF);
-    read = uart_is_readable(uart1);
+    acio_queue_compact();
+    return success;
+}
 
-    if (read > 0)
+/* hand a received frame to the transaction it answers */
+static void acio_dispatch(const struct ac_io_message *resp, int size)
+{
+    for (uint8_t i = 0; i < acio_queue_count; i++)
     {
+        struct acio_transaction *txn = acio_queue[i];
 
-        /* recv_buf[0] is already the first byte of the message.
-           now read until nothing's left */
-        recv_size++;
-
-        /* important: we have to know how much data we expect
-           and have to read until we reach the requested amount.
-           Because this can be interrupted by 0 reads and we
-           need to handle escaping (which relies on an up to
-           date recv_buf[recv_size]) we loop until we get a
-           non-zero read. */
-        while (size > 0)
+        if (txn->state != ACIO_TRANSACTION_SENT || txn->seq_no != resp->cmd.seq_no)
         {
+            continue;
+        }
 
-            /* we reached the NUMBYTE field, update size accordingly */
-            if (recv_size == 5)
-            {
-#ifdef ACIO_DEBUG
-                printf(" remaining data size is ");
-                printf("%d", recv_buf[recv_size - 1]);
-#endif
-                size = recv_buf[recv_size - 1] + 1;
-            }
-
-            do
-            {
-                while (!uart_is_readable(uart1)) {
-                    tight_loop_contents();
-                }
-                uart_read_blocking(uart1, recv_buf + recv_size, 1);
-                read = 1;
-            } while (read == 0);
-
-            if (read < 0)
-            {
-                break;
-            }
+        /* the node answers in order, anything sent before this one
+           won't get a response anymore */
+        for (uint8_t j = 0; j < acio_queue_count; j++)
+        {
+            struct acio_transaction *older = acio_queue[j];
 
-            /* check for escape byte. these don't count towards the
-               size we expect! */
-            if (recv_buf[recv_size] == AC_IO_ESCAPE)
+            if (older->state == ACIO_TRANSACTION_SENT &&
+                (int32_t)(older->send_order - txn->send_order) < 0)
             {
-                /* next byte is our real data
-                   overwrite escape byte */
-                do
-                {
-                    while (!uart_is_readable(uart1)) {
-                        tight_loop_contents();
-                    }
-                    uart_read_blocking(uart1, recv_buf + recv_size, 1);
-                    read = 1;
-                } while (read == 0);
-
-                if (read < 0)
-                {
-                    break;
-                }
-
-                recv_buf[recv_size] = ~recv_buf[recv_size];
+                acio_fail(older, ACIO_ERR_TIMEOUT);
             }
-
-            recv_size += read;
-            size -= read;
         }
 
-        /* recv_size - 1: omit checksum for checksum calc */
-        for (int i = 0; i < recv_size - 1; i++)
+        /* sanity check */
+        if (txn->code != resp->cmd.code)
         {
-            checksum += recv_buf[i];
-            buffer[i] = recv_buf[i]; // copy to buffer
-        }
-
-        result_size = recv_size - 1;
 #ifdef ACIO_DEBUG
-        printf("RECV : ");
-        for (int i = 0; i < recv_size; i++)
-        {
-            if (recv_buf[i] < 0x10)
-                printf("0");
-            printf("%X", recv_buf[i]);
-            printf(" ");
-        }
-        printf("\n");
+            printf("Received invalid response ");
+            printf("%X", resp->cmd.code);
+            printf(" for request ");
+            printf("%X", txn->code);
+            printf("\n");
 #endif
-        if (checksum != recv_buf[recv_size - 1])
+            acio_fail(txn, ACIO_ERR_CODE_MISMATCH);
+            return;
+        }
+
+        if (resp->cmd.nbytes < txn->resp_nbytes)
         {
 #ifdef ACIO_DEBUG
-            printf("Invalid message checksum: \n");
-            printf("%X", checksum);
-            printf(" != ");
-            printf("%X", recv_buf[recv_size - 1]);
+            printf("Received ");
+            printf("%d", resp->cmd.nbytes);
+            printf(" bytes for request ");
+            printf("%X", txn->code);
+            printf(", expected ");
+            printf("%d", txn->resp_nbytes);
             printf("\n");
 #endif
-            return -1;
+            acio_fail(txn, ACIO_ERR_SHORT);
+            return;
         }
 
-        return result_size; // checksum doesn't count
+        memcpy(txn->msg, resp, size);
+        acio_complete(txn, ACIO_OK);
+        return;
     }
 
-    return -1;
+#ifdef ACIO_DEBUG
+    printf("Dropping response ");
+    printf("%X", resp->cmd.code);
+    printf(" with unknown seq ");
+    printf("%X", resp->cmd.seq_no);
+    printf("\n");
+#endif
 }
 
-int acio_get_counter_and_increase()
+/* oldest transaction still waiting for its response */
+static struct acio_transaction *acio_queue_head()
 {
-    return acio_msg_counter++;
+    struct acio_transaction *head = NULL;
+
+    for (uint8_t i = 0; i < acio_queue_count; i++)
+    {
+        struct acio_transaction *txn = acio_queue[i];
+
+        if (txn->state == ACIO_TRANSACTION_SENT &&
+            (head == NULL || (int32_t)(txn->send_order - head->send_order) < 0))
+        {
+            head = txn;
+        }
+    }
+
+    return head;
 }
 
-bool acio_send_and_recv(struct ac_io_message *msg, int resp_size)
+void acio_poll()
 {
-#ifdef ACIO_DEBUG
-    printf("ACIO SEND AND RECV\n");
-#endif
-    msg->cmd.seq_no = acio_msg_counter++;
-    int send_size = offsetof(struct ac_io_message, cmd.raw) + msg->cmd.nbytes;
-
-    if (!acio_send((uint8_t *)msg, send_size))
+    while (true)
     {
-        return false;
-    }
+        int size = acio_receive(&acio_rx_msg);
 
-    // delay(100); //wait a little between send and receive
+        if (size == 0)
+        {
+            break;
+        }
 
-    /* remember the sent cmd for sanity check */
-    uint16_t req_code = msg->cmd.code;
+        if (size > 0)
+        {
+            acio_dispatch(&acio_rx_msg, size);
+        }
+        else
+        {
+            /* a broken frame can only be the answer to the oldest request */
+            struct acio_transaction *head = acio_queue_head();
+            if (head != NULL)
+            {
+                acio_fail(head, acio_rx_error);
+            }
+        }
+    }
 
-    if (acio_receive((uint8_t *)msg, resp_size) <= 0)
+    /* a node that goes quiet, even in the middle of a frame, only
+       stalls us until the deadline */
+    uint64_t now = hal_time_us();
+    for (uint8_t i = 0; i < acio_queue_count; i++)
     {
-        return false;
+        struct acio_transaction *txn = acio_queue[i];
+
+        if (txn->state == ACIO_TRANSACTION_SENT && now >= txn->deadline)
+        {
+            acio_fail(txn, ACIO_ERR_TIMEOUT);
+        }
     }
 
-    /* sanity check */
-    if (req_code != msg->cmd.code)
+    acio_queue_compact();
+}
+
+bool acio_wait(struct acio_transaction *txn)
+{
+    while (txn->state == ACIO_TRANSACTION_QUEUED || txn->state == ACIO_TRANSACTION_SENT)
     {
+        acio_flush();
+        acio_poll();
+        hal_idle();
+    }
+
+    acio_last_error = txn->error;
+    return txn->state == ACIO_TRANSACTION_DONE;
+}
+
+enum acio_error acio_get_last_error()
+{
+    return acio_last_error;
+}
+
+void acio_get_stats(struct acio_stats *stats)
+{
+    *stats = acio_stats;
+}
+
+bool acio_send_and_recv(struct ac_io_message *msg, uint8_t resp_nbytes)
+{
 #ifdef ACIO_DEBUG
-        printf("Received invalid response ");
-        printf("%X", msg->cmd.code);
-        printf(" for request ");
-        printf("%X", req_code);
-        printf("\n");
+    printf("ACIO SEND AND RECV\n");
 #endif
+    struct acio_transaction txn;
+
+    acio_transaction_init(&txn, msg, resp_nbytes, NULL, NULL);
+
+    if (!acio_submit(&txn))
+    {
+        acio_last_error = txn.error;
         return false;
     }
 
-    return true;
+    return acio_wait(&txn);
 }
 
-static bool acio_init(void)
+/* init/reset the device by sending 0xAA until it answers with enough 0xAA
+   in a row. At a rate the node doesn't follow, the echoes come back garbled. */
+static bool acio_handshake(uint64_t timeout_us)
 {
+    uint64_t deadline = hal_time_us() + timeout_us;
+    uint8_t read_buff = 0x00;
+    int clean = 0;
 
-int retry = 3;
+    acio_reset_rx();
 
+    while (clean < ACIO_INIT_CLEAN_ECHOES)
+    {
+        if (hal_time_us() >= deadline)
+        {
 #ifdef ACIO_DEBUG
-    printf("INIT DEVICE \n");
+            printf("No clean SOF echo before deadline \n");
 #endif
-    uint8_t read_buff = 0x00;
-    /* init/reset the device by sending 0xAA until 0xAA is returned */
-    do
-    {
-        if (retry == 3) {
             return false;
         }
 
-        uart_putc(uart1, AC_IO_SOF);
+        hal_uart_putc(AC_IO_SOF);
 
 #ifdef ACIO_DEBUG
         printf("Sent : 0xAA \n");
 #endif
-        if (!uart_is_readable(uart1))
+        /* give the node a moment to echo before sending the next one */
+        uint64_t echo_deadline = hal_time_us() + ACIO_INIT_ECHO_US;
+        while (!hal_uart_available() && hal_time_us() < echo_deadline)
         {
-            retry++;
-            continue;
+            hal_idle();
         }
 
-        read_buff = uart_getc(uart1);
-
-        // if nothing is received no device is connected
-        if (read_buff == 0xFF)
+        if (!hal_uart_available())
         {
-#ifdef ACIO_DEBUG
-            printf("No device connected \n");
-#endif
-            return false;
+            clean = 0;
+            continue;
         }
 
+        hal_uart_read(&read_buff, 1);
+
 #ifdef ACIO_DEBUG
         printf("Recv : 0x");
         printf("%X", read_buff);
         printf("\n");
 #endif
-    } while ((read_buff != AC_IO_SOF));
+        clean = read_buff == AC_IO_SOF ? clean + 1 : 0;
+    }
 
 #ifdef ACIO_DEBUG
     printf("Obtained SOF, clearing out buffer now \n");
 #endif
-    while (uart_is_readable(uart1))
-    {
-        uart_getc(uart1);
-    }
+    /* let the echoes of our remaining SOFs arrive before flushing */
+    hal_sleep_ms(ACIO_INIT_SETTLE_MS);
+    acio_reset_rx();
 
 #ifdef ACIO_DEBUG
     printf("Buffer cleared \n");
@@ -317,6 +628,32 @@ int retry = 3;
     return true;
 }
 
+static bool acio_init_at(uint32_t baudrate, uint64_t timeout_us)
+{
+#ifdef ACIO_DEBUG
+    printf("INIT DEVICE at %lu baud \n", (unsigned long)baudrate);
+#endif
+    hal_uart_set_baudrate(baudrate);
+    acio_baudrate = baudrate;
+
+    return acio_handshake(timeout_us);
+}
+
+static bool acio_init(void)
+{
+    /* fastest first, the first rate the node echoes cleanly at wins */
+    for (size_t i = 0; i < sizeof(acio_baudrates) / sizeof(acio_baudrates[0]); i++)
+    {
+        if (acio_init_at(acio_baudrates[i], ACIO_PROBE_TIMEOUT_US))
+        {
+            return true;
+        }
+    }
+
+    /* nothing answered cleanly, give the default rate the full timeout */
+    return acio_init_at(ACIO_DEFAULT_BAUDRATE, ACIO_INIT_TIMEOUT_US);
+}
+
 static uint8_t acio_enum_nodes(void)
 {
     struct ac_io_message msg;
@@ -329,7 +666,7 @@ static uint8_t acio_enum_nodes(void)
 #ifdef ACIO_DEBUG
     printf("Enumerating nodes... \n");
 #endif
-    if (!acio_send_and_recv(&msg, offsetof(struct ac_io_message, cmd.raw) + 1))
+    if (!acio_send_and_recv(&msg, 1))
     {
 #ifdef ACIO_DEBUG
         printf("Enumerating nodes failed \n");
@@ -341,6 +678,11 @@ static uint8_t acio_enum_nodes(void)
     printf("%d", msg.cmd.count);
     printf(" nodes. \n");
 #endif
+    /* the count comes off the wire, a bad one mustn't overrun the node tables */
+    if (msg.cmd.count > ACIO_MAX_NODES)
+    {
+        return ACIO_MAX_NODES;
+    }
     return msg.cmd.count;
 }
 
@@ -352,10 +694,7 @@ static bool acio_get_version(uint8_t node_id, char product[4])
     msg.cmd.code = ac_io_u16(AC_IO_CMD_GET_VERSION);
     msg.cmd.nbytes = 0;
 
-    if (!acio_send_and_recv(
-            &msg,
-            offsetof(struct ac_io_message, cmd.raw) +
-                sizeof(struct ac_io_version)))
+    if (!acio_send_and_recv(&msg, sizeof(struct ac_io_version)))
     {
         //        printf("Get version of node %d failed\n", node_id);
         return false;
@@ -396,8 +735,7 @@ static bool acio_start_node(uint8_t node_id)
     msg.cmd.code = ac_io_u16(AC_IO_CMD_START_UP);
     msg.cmd.nbytes = 0;
 
-    if (!acio_send_and_recv(
-            &msg, offsetof(struct ac_io_message, cmd.raw) + 1))
+    if (!acio_send_and_recv(&msg, 1))
     {
         //        printf("Starting node %d failed\n", node_id);
         return false;
@@ -407,6 +745,36 @@ static bool acio_start_node(uint8_t node_id)
     return true;
 }
 
+bool acio_bringup_retry(uint64_t deadline)
+{
+    if (hal_time_us() >= deadline)
+    {
+        return false;
+    }
+
+    hal_sleep_ms(ACIO_BRINGUP_RETRY_MS);
+    return true;
+}
+
+uint32_t acio_get_baudrate()
+{
+    return acio_baudrate;
+}
+
+uint8_t acio_get_node_count()
+{
+    return acio_node_count;
+}
+
+const char *acio_get_node_product(uint8_t node_id)
+{
+    if (node_id >= acio_node_count)
+    {
+        return NULL;
+    }
+    return acio_node_products[node_id];
+}
+
 bool acio_open()
 {
     bool init_success = acio_init();
@@ -417,26 +785,43 @@ bool acio_open()
     }
 
     acio_node_count = acio_enum_nodes();
+    if (acio_node_count == 0 && acio_baudrate != ACIO_DEFAULT_BAUDRATE)
+    {
+        /* the node echoed at the faster rate but doesn't talk at it */
+        if (acio_init_at(ACIO_DEFAULT_BAUDRATE, ACIO_INIT_TIMEOUT_US))
+        {
+            acio_node_count = acio_enum_nodes();
+        }
+    }
+
     if (acio_node_count == 0)
     {
         return false;
     }
+    /* ask again as soon as a node that isn't ready yet fails to answer,
+       rather than waiting a fixed time before every command */
     for (uint8_t i = 0; i < acio_node_count; i++)
     {
-        sleep_ms(500);
-        if (!acio_get_version(
+        uint64_t deadline = hal_time_us() + ACIO_BRINGUP_TIMEOUT_US;
+        while (!acio_get_version(
                 i + 1, acio_node_products[i]))
         {
-            return false;
+            if (!acio_bringup_retry(deadline))
+            {
+                return false;
+            }
         }
     }
 
     for (uint8_t i = 0; i < acio_node_count; i++)
     {
-        sleep_ms(500);
-        if (!acio_start_node(i + 1))
+        uint64_t deadline = hal_time_us() + ACIO_BRINGUP_TIMEOUT_US;
+        while (!acio_start_node(i + 1))
         {
-            return false;
+            if (!acio_bringup_retry(deadline))
+            {
+                return false;
+            }
         }
     }
 
@@ -0,0 +1,190 @@
+#include "ACIOFrame.h"
+#include <stddef.h>
+
+#define ACIO_FRAME_HEADER_SIZE offsetof(struct ac_io_message, cmd.raw)
+
+static_assert(ACIO_FRAME_ENCODE_CHUNK >= 2, "an escape pair has to fit in a chunk");
+
+static inline bool acio_frame_needs_escape(uint8_t value)
+{
+    return value == AC_IO_SOF || value == AC_IO_ESCAPE;
+}
+
+static inline uint8_t *acio_frame_put(uint8_t *out, uint8_t value)
+{
+    if (acio_frame_needs_escape(value))
+    {
+        *out++ = AC_IO_ESCAPE;
+        value = ~value;
+    }
+    *out++ = value;
+    return out;
+}
+
+int acio_frame_encode(const uint8_t *buffer, int length, acio_frame_sink_t sink, void *ctx)
+{
+    uint8_t chunk[ACIO_FRAME_ENCODE_CHUNK];
+    uint8_t *out = chunk;
+    uint8_t checksum = 0;
+    int written = 0;
+    int i = 0;
+
+    if (length < 0 || length > (int)ACIO_FRAME_MAX_SIZE)
+    {
+        return -1;
+    }
+
+    *out++ = AC_IO_SOF;
+
+    for (;;)
+    {
+        /* as many bytes as surely fit escaped, no check per byte; the
+           checksum needs room for its pair too */
+        int end = i + (int)(chunk + sizeof(chunk) - out) / 2;
+        bool last = end > length;
+        if (last)
+        {
+            end = length;
+        }
+
+        for (; i < end; i++)
+        {
+            checksum += buffer[i];
+            out = acio_frame_put(out, buffer[i]);
+        }
+
+        if (last)
+        {
+            out = acio_frame_put(out, checksum);
+            break;
+        }
+
+        if (!sink(chunk, out - chunk, ctx))
+        {
+            return -1;
+        }
+        written += out - chunk;
+        out = chunk;
+    }
+
+    if (!sink(chunk, out - chunk, ctx))
+    {
+        return -1;
+    }
+
+    return written + (out - chunk);
+}
+
+ACIODecoder::ACIODecoder()
+    : frames(0), checksum_errors(0), framing_errors(0),
+      target(NULL), st(WAIT_SOF), pos(0), expected(-1), checksum(0)
+{
+}
+
+void ACIODecoder::begin(struct ac_io_message *msg)
+{
+    target = (uint8_t *)msg;
+    /* keep a SOF that was just seen, it already starts the next frame */
+    if (st == ESCAPED || pos > 0)
+    {
+        st = WAIT_SOF;
+    }
+    pos = 0;
+    expected = -1;
+    checksum = 0;
+}
+
+void ACIODecoder::reset()
+{
+    st = WAIT_SOF;
+    pos = 0;
+    expected = -1;
+    checksum = 0;
+}
+
+bool ACIODecoder::in_frame() const
+{
+    return st != WAIT_SOF;
+}
+
+int ACIODecoder::frame_size() const
+{
+    return pos;
+}
+
+acio_decode_status ACIODecoder::push(const uint8_t *data, int length, int *consumed)
+{
+    int i = 0;
+
+    while (i < length)
+    {
+        uint8_t value = data[i++];
+
+        if (value == AC_IO_SOF)
+        {
+            /* a SOF is never escaped, seeing one inside a frame means bytes
+               got lost. It also starts the next frame, so resync on it. */
+            bool broken = (st == ESCAPED) || (st == DATA && pos > 0);
+
+            st = DATA;
+            pos = 0;
+            expected = -1;
+            checksum = 0;
+
+            if (broken)
+            {
+                framing_errors++;
+                *consumed = i;
+                return ACIO_DECODE_FRAMING_ERROR;
+            }
+
+            /* a varying amount of SOFs can precede a frame */
+            continue;
+        }
+
+        if (st == WAIT_SOF)
+        {
+            /* line noise between frames */
+            continue;
+        }
+
+        if (st == ESCAPED)
+        {
+            value = ~value;
+            st = DATA;
+        }
+        else if (value == AC_IO_ESCAPE)
+        {
+            st = ESCAPED;
+            continue;
+        }
+
+        if (pos == expected)
+        {
+            /* checksum byte, doesn't go into the message */
+            st = WAIT_SOF;
+            *consumed = i;
+
+            if (value != checksum)
+            {
+                checksum_errors++;
+                return ACIO_DECODE_CHECKSUM_ERROR;
+            }
+
+            frames++;
+            return ACIO_DECODE_FRAME;
+        }
+
+        target[pos++] = value;
+        checksum += value;
+
+        /* we reached the NUMBYTE field, now we know the frame size */
+        if (pos == ACIO_FRAME_HEADER_SIZE)
+        {
+            expected = ACIO_FRAME_HEADER_SIZE + value;
+        }
+    }
+
+    *consumed = i;
+    return ACIO_DECODE_PENDING;
+}
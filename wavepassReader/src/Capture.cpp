@@ -0,0 +1,62 @@
+#include "Capture.h"
+#include "HAL.h"
+#include "RingBuffer.h"
+
+static RingBuffer<CAPTURE_BUFFER_SIZE> capture_ring;
+static bool capture_enabled;
+static bool capture_overflow;
+static uint32_t capture_dropped;
+
+void capture_set_enabled(bool enabled)
+{
+    /* a new reader starts with fresh records */
+    if (enabled && !capture_enabled)
+    {
+        capture_ring.clear();
+        capture_overflow = false;
+    }
+    capture_enabled = enabled;
+}
+
+bool capture_is_enabled()
+{
+    return capture_enabled;
+}
+
+void capture_frame(bool rx, enum capture_status status, const uint8_t *frame, int length)
+{
+    if (!capture_enabled)
+    {
+        return;
+    }
+
+    struct capture_record record;
+    uint16_t size = sizeof(record) + length;
+
+    if (capture_ring.free() < size)
+    {
+        capture_dropped++;
+        capture_overflow = true;
+        return;
+    }
+
+    record.sync = CAPTURE_SYNC;
+    record.flags = (rx ? CAPTURE_DIR_RX : 0) | (capture_overflow ? CAPTURE_OVERFLOW : 0) | status;
+    record.node = length > 0 ? frame[0] & 0x7F : 0xFF;
+    record.length = length;
+    record.time_us = (uint32_t)hal_time_us();
+
+    capture_ring.write((const uint8_t *)&record, sizeof(record));
+    capture_ring.write(frame, length);
+    capture_overflow = false;
+}
+
+int capture_read(uint8_t *buffer, int size)
+{
+    return capture_ring.read(buffer, size);
+}
+
+uint32_t capture_get_dropped()
+{
+    return capture_dropped;
+}
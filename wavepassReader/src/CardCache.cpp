@@ -0,0 +1,113 @@
+#include "CardCache.h"
+#include <string.h>
+
+struct card_cache_entry
+{
+    uint8_t uid[8];
+    uint8_t node_id;
+    bool used;
+    bool present;    /* on node_id right now */
+    uint64_t seen_us; /* last cycle it was read in, or its removal */
+};
+
+static struct card_cache_entry card_cache[CARD_CACHE_SIZE];
+static uint32_t card_cache_holdoff_us;
+
+void card_cache_init(uint32_t holdoff_us)
+{
+    memset(card_cache, 0, sizeof(card_cache));
+    card_cache_holdoff_us = holdoff_us;
+}
+
+static struct card_cache_entry *card_cache_on_node(uint8_t node_id)
+{
+    for (int i = 0; i < CARD_CACHE_SIZE; i++)
+    {
+        if (card_cache[i].used && card_cache[i].present && card_cache[i].node_id == node_id)
+        {
+            return &card_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static struct card_cache_entry *card_cache_find(const uint8_t *uid)
+{
+    for (int i = 0; i < CARD_CACHE_SIZE; i++)
+    {
+        if (card_cache[i].used && memcmp(card_cache[i].uid, uid, 8) == 0)
+        {
+            return &card_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* a free entry, else the card gone the longest, else the oldest one */
+static struct card_cache_entry *card_cache_victim()
+{
+    struct card_cache_entry *victim = NULL;
+
+    for (int i = 0; i < CARD_CACHE_SIZE; i++)
+    {
+        struct card_cache_entry *e = &card_cache[i];
+        if (!e->used)
+        {
+            return e;
+        }
+        if (victim == NULL || (victim->present && !e->present) ||
+            (victim->present == e->present && e->seen_us < victim->seen_us))
+        {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+enum card_cache_event card_cache_update(uint8_t node_id, uint8_t type, const uint8_t *uid, uint64_t now)
+{
+    struct card_cache_entry *current = card_cache_on_node(node_id);
+
+    if (type == 0)
+    {
+        if (current == NULL)
+        {
+            return CARD_CACHE_NONE;
+        }
+        current->present = false;
+        current->seen_us = now;
+        return CARD_CACHE_REMOVED;
+    }
+
+    if (current != NULL)
+    {
+        if (memcmp(current->uid, uid, 8) == 0)
+        {
+            current->seen_us = now;
+            return CARD_CACHE_NONE;
+        }
+        current->present = false;
+        current->seen_us = now;
+    }
+
+    struct card_cache_entry *e = card_cache_find(uid);
+    if (e != NULL && (e->present || now - e->seen_us < card_cache_holdoff_us))
+    {
+        /* still the same presentation */
+        e->node_id = node_id;
+        e->present = true;
+        e->seen_us = now;
+        return CARD_CACHE_NONE;
+    }
+
+    if (e == NULL)
+    {
+        e = card_cache_victim();
+        memcpy(e->uid, uid, 8);
+        e->used = true;
+    }
+    e->node_id = node_id;
+    e->present = true;
+    e->seen_us = now;
+    return CARD_CACHE_INSERTED;
+}
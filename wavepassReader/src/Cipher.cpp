@@ -1,4 +1,5 @@
 #include "Cipher.h"
+#include <string.h>
 
 void Cipher::setKeys(unsigned long client_key, unsigned long reader_key)
 {
@@ -7,51 +8,239 @@ void Cipher::setKeys(unsigned long client_key, unsigned long reader_key)
     keyarray[1] = client_key  ^ 521288629; //second key : received XOR 521288629
     keyarray[2] = reader_key ^ 362436069; // third key : cryptkey XOR random?
     keyarray[3] = client_key  ^ 123456789; // fourth key : received XOR random?
+    keystream_head = 0;
+    keystream_tail = 0;
 }
 
+// CRC tables are generated at compile time and stay in flash.
+// The classic byte table is always there, the three slice-by-4 ones
+// only with CIPHER_CRC_SLICE_BY_4.
+struct CipherCRCTable
+{
+    uint16_t t[256];
+};
+
+static constexpr CipherCRCTable makeCRCTable()
+{
+    CipherCRCTable table = {};
+
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t crc = i << 8;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+        table.t[i] = crc;
+    }
+    return table;
+}
+
+static constexpr CipherCRCTable crc_table = makeCRCTable();
+static_assert(crc_table.t[1] == 0x1021 && crc_table.t[255] == 0x1ef0, "CRC-CCITT table");
+
+static inline uint16_t crcStep(uint16_t crc, unsigned char data)
+{
+    return crc_table.t[(data ^ (crc >> 8)) & 0xff] ^ (uint16_t)(crc << 8);
+}
+
+#ifdef CIPHER_CRC_SLICE_BY_4
+// t[k - 1] gives the effect of a byte followed by k zero bytes
+struct CipherCRCSliceTables
+{
+    uint16_t t[3][256];
+};
+
+static constexpr CipherCRCSliceTables makeCRCSliceTables()
+{
+    CipherCRCSliceTables tables = {};
+
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t prev = k == 0 ? crc_table.t[i] : tables.t[k - 1][i];
+            tables.t[k][i] = (uint16_t)(prev << 8) ^ crc_table.t[prev >> 8];
+        }
+    }
+    return tables;
+}
+
+static constexpr CipherCRCSliceTables crc_slice_tables = makeCRCSliceTables();
+#endif
+
 unsigned short Cipher::CRCCCITT(unsigned char *data, unsigned int length)
 {
+#ifdef CIPHER_CRC_SLICE_BY_4
+    return CRCCCITTSlice4(data, length);
+#else
+    return CRCCCITTByteWise(data, length);
+#endif
+}
 
-    unsigned int count;
-    unsigned long crc = 0;
-    unsigned long temp;
+unsigned short Cipher::CRCCCITTByteWise(const unsigned char *data, unsigned int length)
+{
+    uint16_t crc = 0;
 
-    for (count = 0; count < length; count++)
+    for (unsigned int count = 0; count < length; count++)
     {
-        temp = (data[count] ^ (crc >> 8)) & 0xff;
-        crc = crc_table[temp] ^ (crc << 8);
+        crc = crcStep(crc, data[count]);
     }
 
-    return (unsigned int)crc;
+    return crc;
+}
 
+#ifdef CIPHER_CRC_SLICE_BY_4
+// four bytes per step: the CRC only overlaps the first two
+unsigned short Cipher::CRCCCITTSlice4(const unsigned char *data, unsigned int length)
+{
+    uint16_t crc = 0;
+    unsigned int count = 0;
+
+    for (; count + 4 <= length; count += 4)
+    {
+        crc = crc_slice_tables.t[2][(crc >> 8) ^ data[count]] ^
+              crc_slice_tables.t[1][(crc & 0xff) ^ data[count + 1]] ^
+              crc_slice_tables.t[0][data[count + 2]] ^
+              crc_table.t[data[count + 3]];
+    }
+    for (; count < length; count++)
+    {
+        crc = crcStep(crc, data[count]);
+    }
+
+    return crc;
 }
+#endif
 
+// next keystream word, precomputed if refill() got to it
+inline uint32_t Cipher::nextKey()
+{
+    if (keystream_tail != keystream_head)
+    {
+        return keystream[keystream_tail++ & (CIPHER_KEYSTREAM_WORDS - 1)];
+    }
+    return stepKey();
+}
+
+// advance the xorshift state by one word, returns the new keystream word
+inline uint32_t Cipher::stepKey()
+{
+    uint32_t key1 = keyarray[0];
+    uint32_t key4 = keyarray[3];
+    uint32_t key4new = (key4 << 11) ^ key4;
+    keyarray [3] = keyarray[2];
+    keyarray [2] = keyarray [1];
+    keyarray [1] = key1;
+    keyarray [0] = ((((key1 >> 11) ^ key4new) >> 8) ^ key4new ^ key1);      // new key
+    return keyarray[0];
+}
+
+static_assert((CIPHER_KEYSTREAM_WORDS & (CIPHER_KEYSTREAM_WORDS - 1)) == 0 && CIPHER_KEYSTREAM_WORDS < 256,
+              "CIPHER_KEYSTREAM_WORDS must be a power of two below 256");
+
+void Cipher::refill()
+{
+    while ((uint8_t)(keystream_head - keystream_tail) < CIPHER_KEYSTREAM_WORDS)
+    {
+        keystream[keystream_head & (CIPHER_KEYSTREAM_WORDS - 1)] = stepKey();
+        keystream_head++;
+    }
+}
 
+// every call starts on a fresh keystream word, bytes take the word
+// most significant byte first. One state step per 4 bytes.
 void Cipher::crypt(unsigned char* data, unsigned int length)
 {
     unsigned int i = 0;
-    if (length > 0)
+
+    if (((uintptr_t)data & 3) == 0)
+    {
+        // aligned buffer: xor whole words, the key word in memory order
+        unsigned char *words = (unsigned char *)__builtin_assume_aligned(data, 4);
+        for (; i + 4 <= length; i += 4)
+        {
+            uint32_t key = nextKey();
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            key = __builtin_bswap32(key);
+#endif
+            uint32_t word;
+            memcpy(&word, words + i, 4);
+            word ^= key;
+            memcpy(words + i, &word, 4);
+        }
+    }
+    else
     {
-        do
+        // Cortex-M0+ can't load unaligned words, still one step per word
+        // and fixed shifts (msg.cmd.raw sits at offset 5)
+        for (; i + 4 <= length; i += 4)
         {
-            int ilow = i & 3;                       // 2lower bits of i
+            uint32_t key = nextKey();
+            data[i] ^= (unsigned char)(key >> 24);
+            data[i + 1] ^= (unsigned char)(key >> 16);
+            data[i + 2] ^= (unsigned char)(key >> 8);
+            data[i + 3] ^= (unsigned char)key;
+        }
+    }
 
-            if (ilow == 0)                          // shiftkeys every 4bytes
-            {
-                unsigned long key1 = keyarray[0];
-                unsigned long key4 = keyarray[3];
-                unsigned long key4new = (key4 << 11) ^ key4;
-                keyarray [3] = keyarray[2];
-                keyarray [2] = keyarray [1];
-                keyarray [1] = key1;
-                keyarray [0] = ((((key1 >> 11) ^ key4new) >> 8) ^ key4new ^ key1);      // new key
-            }
+    // tail: the rest of one more word is dropped
+    if (i < length)
+    {
+        uint32_t key = nextKey();
+        for (int shift = 24; i < length; i++, shift -= 8)
+        {
+            data[i] ^= (unsigned char)(key >> shift);
+        }
+    }
+}
 
-            // xor with key
-            data[i] = (unsigned char) ( keyarray[0] >> ((3 - ilow) << 3) ^ data[i] );
-            i++;
+// single pass for encrypted poll answers: in is read once, the plaintext
+// goes straight to its destination and feeds the CRC on the way
+bool Cipher::decryptChecked(const unsigned char *in, unsigned char *out, unsigned int length, uint16_t *crc)
+{
+    uint16_t crc_calc = 0;
+    uint16_t crc_recv = 0;
+    unsigned int total = length + 2;
+    unsigned int i = 0;
+    uint32_t key = 0;
 
+    for (; i + 4 <= length; i += 4)
+    {
+        key = nextKey();
+        unsigned char b0 = in[i] ^ (unsigned char)(key >> 24);
+        unsigned char b1 = in[i + 1] ^ (unsigned char)(key >> 16);
+        unsigned char b2 = in[i + 2] ^ (unsigned char)(key >> 8);
+        unsigned char b3 = in[i + 3] ^ (unsigned char)key;
+        out[i] = b0;
+        out[i + 1] = b1;
+        out[i + 2] = b2;
+        out[i + 3] = b3;
+        crc_calc = crcStep(crcStep(crcStep(crcStep(crc_calc, b0), b1), b2), b3);
+    }
+
+    // rest of the payload and the CRC, which may share a key word with it
+    for (; i < total; i++)
+    {
+        if ((i & 3) == 0)
+        {
+            key = nextKey();
+        }
+        unsigned char b = in[i] ^ (unsigned char)(key >> (24 - 8 * (i & 3)));
+        if (i < length)
+        {
+            out[i] = b;
+            crc_calc = crcStep(crc_calc, b);
+        }
+        else
+        {
+            crc_recv = (uint16_t)(crc_recv << 8) | b;
         }
-        while (i < length);
     }
-}
\ No newline at end of file
+
+    if (crc != NULL)
+    {
+        *crc = crc_recv;
+    }
+    return crc_recv == crc_calc;
+}
@@ -0,0 +1,144 @@
+#include "HAL.h"
+#include "RingBuffer.h"
+#include "pico/stdlib.h"
+#include "hardware/uart.h"
+#include "hardware/irq.h"
+
+#define ACIO_UART uart1
+#define ACIO_UART_IRQ UART1_IRQ
+#define ACIO_UART_TX_PIN 6
+#define ACIO_UART_RX_PIN 7
+
+static RingBuffer<HAL_UART_RX_BUFFER_SIZE> rx_ring;
+static volatile uint32_t rx_bytes;
+static volatile uint32_t rx_overruns;
+static volatile uint32_t rx_irqs;
+static void (*idle_hook)();
+static bool in_idle_hook;
+
+/* fires on RX FIFO level and RX timeout, empties the whole FIFO at once */
+static void hal_uart_rx_irq(void)
+{
+    uart_hw_t *hw = uart_get_hw(ACIO_UART);
+
+    rx_irqs++;
+    while (uart_is_readable(ACIO_UART))
+    {
+        uint32_t dr = hw->dr;
+        if (dr & UART_UARTDR_OE_BITS)
+        {
+            rx_overruns++;
+        }
+        rx_ring.push(dr & UART_UARTDR_DATA_BITS);
+        rx_bytes++;
+    }
+}
+
+void hal_uart_init(uint32_t baudrate)
+{
+    uart_init(ACIO_UART, baudrate);
+    gpio_set_function(ACIO_UART_TX_PIN, GPIO_FUNC_UART);
+    gpio_set_function(ACIO_UART_RX_PIN, GPIO_FUNC_UART);
+    uart_set_hw_flow(ACIO_UART, false, false);
+    uart_set_format(ACIO_UART, 8, 1, UART_PARITY_NONE);
+    /* keep the 32 byte FIFO, the IRQ drains it into the ring */
+    uart_set_fifo_enabled(ACIO_UART, true);
+
+    irq_set_exclusive_handler(ACIO_UART_IRQ, hal_uart_rx_irq);
+    irq_set_enabled(ACIO_UART_IRQ, true);
+    uart_set_irq_enables(ACIO_UART, true, false);
+}
+
+uint32_t hal_uart_set_baudrate(uint32_t baudrate)
+{
+    /* let pending output leave at the old rate */
+    uart_tx_wait_blocking(ACIO_UART);
+    return uart_set_baudrate(ACIO_UART, baudrate);
+}
+
+int hal_uart_available()
+{
+    return rx_ring.available();
+}
+
+int hal_uart_read(uint8_t *buffer, int size)
+{
+    return rx_ring.read(buffer, size);
+}
+
+bool hal_uart_write(const uint8_t *buffer, int length)
+{
+    /* only waits while the 32 byte TX FIFO is full */
+    uart_write_blocking(ACIO_UART, buffer, length);
+    return true;
+}
+
+void hal_uart_putc(uint8_t value)
+{
+    uart_putc_raw(ACIO_UART, value);
+}
+
+void hal_uart_flush_rx()
+{
+    rx_ring.clear();
+}
+
+void hal_uart_get_stats(struct hal_uart_stats *stats)
+{
+    stats->rx_bytes = rx_bytes;
+    stats->rx_dropped = rx_ring.dropped_count();
+    stats->rx_overruns = rx_overruns;
+    stats->rx_irqs = rx_irqs;
+}
+
+uint64_t hal_time_us()
+{
+    return time_us_64();
+}
+
+void hal_sleep_ms(uint32_t ms)
+{
+    hal_sleep_us((uint64_t)ms * 1000);
+}
+
+void hal_sleep_us(uint64_t us)
+{
+    if (idle_hook == NULL)
+    {
+        sleep_us(us);
+        return;
+    }
+
+    uint64_t end = time_us_64() + us;
+    while (time_us_64() < end)
+    {
+        hal_idle();
+    }
+}
+
+void hal_idle()
+{
+    tight_loop_contents();
+    if (idle_hook != NULL && !in_idle_hook)
+    {
+        in_idle_hook = true;
+        idle_hook();
+        in_idle_hook = false;
+    }
+}
+
+void hal_set_idle_hook(void (*hook)())
+{
+    idle_hook = hook;
+}
+
+void hal_gpio_init_pullup(uint8_t pin)
+{
+    gpio_init(pin);
+    gpio_pull_up(pin);
+}
+
+bool hal_gpio_get(uint8_t pin)
+{
+    return gpio_get(pin);
+}
@@ -1,12 +1,149 @@
 #include "ICCx.h"
 #include "Cipher.h"
+#include "HAL.h"
+#include "Capture.h"
+#include "ACIOFrame.h"
 #include <string.h>
 #include <stdio.h>
-#include "pico/stdlib.h"
+#ifndef ICCX_NO_DEBUG
 #define ICCX_DEBUG
+#endif
 //#define LOCK_ONLY_ISO15693
 
-Cipher crypto;
+/* in encrypted mode the node needs a moment between ENGAGE and FEL_POLL
+   (else ICCB fails). How long depends on the model, so the wait starts
+   at what always worked, probes down slowly while polls keep working and
+   backs off when one goes unanswered. A bad CRC is the line or the keys,
+   not the wait, and doesn't count. */
+#define ICCX_PACE_START_US 60000
+#define ICCX_PACE_MAX_US 120000
+#define ICCX_PACE_MIN_US 2000
+/* stay this far above the longest wait seen failing */
+#define ICCX_PACE_MARGIN_US 2000
+/* good polls in a row before trying a shorter wait */
+#define ICCX_PACE_PROBE_POLLS 4
+/* unanswered polls at or below the same wait before it becomes the floor,
+   a single one may just be a lost frame */
+#define ICCX_PACE_FLOOR_STRIKES 2
+/* the floor drops by a quarter after this many good polls or this long,
+   whichever comes first, so probing finds a reader that got quicker */
+#define ICCX_PACE_FLOOR_DECAY_POLLS 256
+#define ICCX_PACE_FLOOR_DECAY_US 30000000
+/* while keys are moving the keypad gets its own lane: polls only, ahead
+   of other due nodes by up to ICCX_KEYPAD_LEAD_US, and the card is only
+   engaged this often. An encrypted reader polls without the ENGAGE wait
+   and no lead, and isn't engaged at all while it holds a card it read. */
+#define ICCX_KEYPAD_ACTIVE_US 2000000
+#define ICCX_KEYPAD_CARD_SCAN_US 250000
+/* bounded, or an unpaced ICCA with keys moving would have the bus to itself */
+#define ICCX_KEYPAD_LEAD_US 20000
+
+/* key edges waiting for the host, power of two */
+#define ICCX_KEY_EDGE_QUEUE 32
+
+/* this many bad CRCs in a row means the keystreams went out of step,
+   a lone one is usually line noise */
+#define ICCX_RESYNC_CRC_FAILURES 3
+
+/* known reader models, the ICCB and ICCC floors aren't known so pacing
+   may go down to ICCX_PACE_MIN_US */
+static const iccx_profile_t iccx_profiles[] = {
+    {{'I', 'C', 'C', 'A'}, false, true, 0},
+    {{'I', 'C', 'C', 'B'}, true, false, ICCX_PACE_MIN_US},
+    {{'I', 'C', 'C', 'C'}, true, false, ICCX_PACE_MIN_US},
+};
+
+/* anything else is taken to be a newer wavepass reader */
+static const iccx_profile_t iccx_profile_default = {{'?', '?', '?', '?'}, true, false, ICCX_PACE_MIN_US};
+
+/* what has been learned about a reader model, shared by its nodes */
+typedef struct iccx_pace_model_s {
+    bool used;
+    char product[4];
+    uint32_t gap_us;
+    uint32_t floor_us;
+} iccx_pace_model_t;
+
+static iccx_pace_model_t iccx_pace_models[ICCX_MAX_NODES];
+
+/* where the card is in an ICCA slot, from the sensors of the last poll */
+enum icca_slot_phase {
+    ICCA_SLOT_EMPTY,          /* both sensors clear, shutter open */
+    ICCA_SLOT_INSERTING,      /* one sensor only, on the way in or out */
+    ICCA_SLOT_LOCKED_VALID,   /* fully in and readable, shutter closed */
+    ICCA_SLOT_LOCKED_INVALID, /* fully in but unreadable, ejected after EJECT_DELAY */
+    ICCA_SLOT_EJECTING,       /* eject sent, waiting for the slot to clear */
+};
+
+/* slot state not known, sent again on the next poll */
+#define ICCA_SLOT_STATE_UNKNOWN 0xFF
+
+enum iccx_step {
+    ICCX_STEP_ENGAGE,
+    ICCX_STEP_POLL,
+};
+
+/* everything we keep per reader, so several of them can share the bus */
+typedef struct iccx_node_s {
+    bool active;
+    iccx_profile_t profile;
+    Cipher crypto;
+    icca_state_t icca_state;
+
+    /* ICCA slot, commands only go out when the phase changes */
+    enum icca_slot_phase slot_phase;
+    uint8_t slot_sent;          /* last slot state sent, or ICCA_SLOT_STATE_UNKNOWN */
+    uint64_t slot_phase_since_us;
+
+    /* scan cycle */
+    enum iccx_step step;
+    uint64_t due_us; /* earliest hal_time_us() for the next step */
+
+    /* keypad lane */
+    uint16_t key_state;            /* from the last good answer */
+    uint64_t keypad_active_until_us;
+    uint64_t card_scan_due_us;     /* next ENGAGE while the keypad is active */
+    bool key_events_synced;        /* key_event_last is from this session */
+    uint8_t key_event_last;        /* newest key_events entry already turned into edges */
+    uint16_t key_edge_state;       /* keys down as far as the edges told */
+
+    /* keystream resync */
+    uint32_t crc_failures;  /* in a row */
+    uint64_t crc_failing_since_us;
+    struct iccx_stats stats;
+
+    /* ENGAGE to FEL_POLL pacing */
+    iccx_pace_model_t *pace_model;
+    uint32_t pace_gap_us;
+    uint32_t pace_floor_us;     /* wait known to be too short, 0 if none */
+    uint8_t pace_successes;     /* good polls since the last change */
+    uint8_t pace_run;           /* unanswered polls in a row */
+    uint32_t pace_suspect_us;   /* wait an earlier run started at, 0 if none */
+    uint8_t pace_strikes;       /* runs that started at or below it */
+    uint16_t pace_floor_polls;  /* good polls since the floor last moved */
+    uint64_t pace_floor_since_us;
+    bool pace_engaged;          /* the next poll follows an ENGAGE, pacing learns from it */
+} iccx_node_t;
+
+static iccx_node_t iccx_nodes[ICCX_MAX_NODES];
+
+static iccx_key_edge_t iccx_key_edges[ICCX_KEY_EDGE_QUEUE];
+static uint8_t iccx_key_edge_head;
+static uint8_t iccx_key_edge_tail;
+
+/* a resent FEL_POLL is answered with the next keystream block, don't retry it.
+   An early poll goes unanswered and pacing probes for that, so don't wait
+   much longer than an answer takes either, the timeout is set from the
+   link speed by iccx_init() */
+static struct acio_retry_policy iccx_fel_poll_policy = {
+    ACIO_RETRY_NONE, 1, 0, 0,
+};
+/* reader time from the end of the request to the start of its answer */
+#define ICCX_FEL_POLL_TURNAROUND_US 10000
+/* the node needs a moment between key exchange attempts */
+static const struct acio_retry_policy iccx_key_exchange_policy = {
+    ACIO_RETRY_BACKOFF, 3, 100000, 50000,
+};
 
 static bool iccx_key_exchange(uint8_t node_id)
 {
@@ -14,13 +151,12 @@ static bool iccx_key_exchange(uint8_t node_id)
     static uint8_t dev_key[4] = {0,0,0,0};
     struct ac_io_message msg;
 
-    msg.addr = node_id;
+    msg.addr = node_id + 1;
     msg.cmd.code = ac_io_u16(AC_IO_CMD_ICCx_KEY_EXCHANGE);
     msg.cmd.nbytes = 4;
     memcpy(&msg.cmd.raw, ard_key, 4);
 
-    if (!acio_send_and_recv(
-            &msg, offsetof(struct ac_io_message, cmd.raw) + msg.cmd.nbytes)) {
+    if (!acio_send_and_recv(&msg, 4)) {
         #ifdef ICCX_DEBUG
         printf("Starting queue loop failed");
             #endif
@@ -43,102 +179,423 @@ printf("\n");
             unsigned long client_key = ((unsigned long) ard_key[0]) <<24 | ((unsigned long) ard_key[1]) <<16 | ((unsigned long) ard_key[2]) <<8 | (unsigned long) ard_key[3];
             unsigned long reader_key = ((unsigned long) dev_key[0]) <<24 | ((unsigned long) dev_key[1]) <<16 | ((unsigned long) dev_key[2]) <<8 | (unsigned long) dev_key[3];
 
-            crypto.setKeys(client_key,reader_key);
+            iccx_nodes[node_id].crypto.setKeys(client_key,reader_key);
 
-    sleep_ms(200);
     return true;
 }
 
-static bool iccx_queue_loop_start(uint8_t node_id, bool encrypted)
+/* deadline bounds the whole bring-up of the node, not just this step */
+static bool iccx_queue_loop_start(uint8_t node_id, bool encrypted, uint64_t deadline)
 {
     struct ac_io_message msg;
 
-    msg.addr = node_id;
+    msg.addr = node_id + 1;
     msg.cmd.code = ac_io_u16(AC_IO_CMD_ICCx_QUEUE_LOOP_START);
     msg.cmd.nbytes = 1;
     msg.cmd.count = 0;
 
-    if (!acio_send_and_recv(
-            &msg, offsetof(struct ac_io_message, cmd.raw) + msg.cmd.nbytes)) {
+    if (!acio_send_and_recv(&msg, 1)) {
         #ifdef ICCX_DEBUG
         printf("Starting queue loop failed");
             #endif
         return false;
-    }    
-    sleep_ms(200);
-    return encrypted?iccx_key_exchange(node_id):true;
+    }
+
+    if (!encrypted) {
+        return true;
+    }
+
+    /* the node may still be starting its queue loop, retry right away
+       instead of waiting a fixed time */
+    while (!iccx_key_exchange(node_id)) {
+        if (!acio_bringup_retry(deadline)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void iccx_pace_init(iccx_node_t *node, uint8_t node_id)
+{
+    const char *product = acio_get_node_product(node_id);
+    iccx_pace_model_t *model = NULL;
+
+    node->pace_model = NULL;
+    node->pace_gap_us = ICCX_PACE_START_US;
+    node->pace_floor_us = 0;
+    node->pace_successes = 0;
+    node->pace_run = 0;
+    node->pace_suspect_us = 0;
+    node->pace_strikes = 0;
+    node->pace_floor_polls = 0;
+    node->pace_floor_since_us = hal_time_us();
+    node->pace_engaged = false;
+
+    if (product == NULL) {
+        return;
+    }
+    for (int i = 0; i < ICCX_MAX_NODES && model == NULL; i++) {
+        if (iccx_pace_models[i].used && memcmp(iccx_pace_models[i].product, product, 4) == 0) {
+            model = &iccx_pace_models[i];
+            /* another node of this model already found its pace */
+            node->pace_gap_us = model->gap_us;
+            node->pace_floor_us = model->floor_us;
+        }
+    }
+    for (int i = 0; i < ICCX_MAX_NODES && model == NULL; i++) {
+        if (!iccx_pace_models[i].used) {
+            model = &iccx_pace_models[i];
+            model->used = true;
+            memcpy(model->product, product, 4);
+            model->gap_us = node->pace_gap_us;
+            model->floor_us = 0;
+        }
+    }
+    node->pace_model = model;
+}
+
+static void iccx_pace_set_floor(iccx_node_t *node, uint32_t floor_us)
+{
+    node->pace_floor_us = floor_us;
+    node->pace_floor_polls = 0;
+    node->pace_floor_since_us = hal_time_us();
+}
+
+/* timed_out: the poll went unanswered, else it was answered */
+static void iccx_pace_update(iccx_node_t *node, bool timed_out)
+{
+    if (timed_out) {
+        if (node->pace_run++ == 0) {
+            uint32_t gap = node->pace_gap_us;
+
+            if (node->pace_suspect_us != 0 && gap <= node->pace_suspect_us) {
+                node->pace_suspect_us = gap;
+                if (++node->pace_strikes >= ICCX_PACE_FLOOR_STRIKES && gap > node->pace_floor_us) {
+                    iccx_pace_set_floor(node, gap);
+                }
+            } else {
+                node->pace_suspect_us = gap;
+                node->pace_strikes = 1;
+            }
+        }
+        node->pace_gap_us += node->pace_gap_us / 4 + ICCX_PACE_MARGIN_US;
+        if (node->pace_gap_us > ICCX_PACE_MAX_US) {
+            node->pace_gap_us = ICCX_PACE_MAX_US;
+        }
+        node->pace_successes = 0;
+    } else if (node->pace_run > 0) {
+        node->pace_run = 0;
+    } else if (++node->pace_successes >= ICCX_PACE_PROBE_POLLS) {
+        uint32_t lowest = node->pace_floor_us + ICCX_PACE_MARGIN_US;
+        uint32_t step = node->pace_gap_us / 16;
+
+        if (lowest < node->profile.min_gap_us) {
+            lowest = node->profile.min_gap_us;
+        }
+        node->pace_gap_us = node->pace_gap_us > lowest + step ? node->pace_gap_us - step : lowest;
+        node->pace_successes = 0;
+    }
+
+    if (!timed_out && node->pace_floor_us > 0 &&
+        (++node->pace_floor_polls >= ICCX_PACE_FLOOR_DECAY_POLLS ||
+         hal_time_us() - node->pace_floor_since_us >= ICCX_PACE_FLOOR_DECAY_US)) {
+        /* what failed before has to fail twice again to count */
+        iccx_pace_set_floor(node, node->pace_floor_us - node->pace_floor_us / 4);
+        node->pace_suspect_us = 0;
+        node->pace_strikes = 0;
+    }
+
+    if (node->pace_model != NULL) {
+        node->pace_model->gap_us = node->pace_gap_us;
+        node->pace_model->floor_us = node->pace_floor_us;
+    }
+    node->stats.poll_gap_us = node->pace_gap_us;
 }
 
-bool iccx_init(uint8_t node_id, bool encrypted)
+const iccx_profile_t *iccx_find_profile(const char *product)
 {
-    if (!iccx_queue_loop_start(node_id + 1, encrypted)) {
+    if (product == NULL) {
+        return &iccx_profile_default;
+    }
+    for (unsigned i = 0; i < sizeof(iccx_profiles) / sizeof(iccx_profiles[0]); i++) {
+        if (memcmp(iccx_profiles[i].product, product, 4) == 0) {
+            return &iccx_profiles[i];
+        }
+    }
+    return &iccx_profile_default;
+}
+
+const iccx_profile_t *iccx_get_profile(uint8_t node_id)
+{
+    if (node_id >= ICCX_MAX_NODES || !iccx_nodes[node_id].active) {
+        return NULL;
+    }
+    return &iccx_nodes[node_id].profile;
+}
+
+/* request and answer fully escaped, 10 bits a byte at the current rate,
+   plus the turnaround: 27ms at 38400 baud, 21ms at 57600, 16ms at 115200.
+   A reader answering later would still step its keystream with the
+   answer thrown away, so this has to hold at the slowest rate too. */
+static uint32_t iccx_fel_poll_timeout_us()
+{
+    uint32_t bytes = ACIO_FRAME_MAX_ENCODED_SIZE(offsetof(struct ac_io_message, cmd.raw) + 1) +
+                     ACIO_FRAME_MAX_ENCODED_SIZE(offsetof(struct ac_io_message, cmd.raw) + sizeof(iccx_state_t) + 2);
+
+    return (uint32_t)((uint64_t)bytes * 10 * 1000000 / acio_get_baudrate()) + ICCX_FEL_POLL_TURNAROUND_US;
+}
+
+bool iccx_init(uint8_t node_id, const iccx_profile_t *profile)
+{
+    iccx_fel_poll_policy.timeout_us = iccx_fel_poll_timeout_us();
+    acio_set_retry_policy(ac_io_u16(AC_IO_CMD_ICCx_FEL_POLL), &iccx_fel_poll_policy);
+    acio_set_retry_policy(ac_io_u16(AC_IO_CMD_ICCx_KEY_EXCHANGE), &iccx_key_exchange_policy);
+
+    if (node_id >= ICCX_MAX_NODES) {
         return false;
     }
 
+    iccx_node_t *node = &iccx_nodes[node_id];
+    node->active = false;
+    node->profile = profile != NULL ? *profile : *iccx_find_profile(acio_get_node_product(node_id));
+    bool encrypted = node->profile.encrypted;
+    memset(&node->icca_state, 0, sizeof(node->icca_state));
+    node->slot_phase = ICCA_SLOT_EMPTY;
+    node->slot_sent = ICCA_SLOT_STATE_UNKNOWN;
+    node->slot_phase_since_us = 0;
+    node->step = ICCX_STEP_ENGAGE;
+    node->due_us = 0;
+    node->crc_failures = 0;
+    node->key_state = 0;
+    node->keypad_active_until_us = 0;
+    node->card_scan_due_us = 0;
+    node->key_events_synced = false;
+    node->key_event_last = 0;
+    node->key_edge_state = 0;
+    /* stats add up over bring-ups, the node memory starts zeroed */
+    iccx_pace_init(node, node_id);
+    node->stats.poll_gap_us = encrypted ? node->pace_gap_us : 0;
+
+    uint64_t deadline = hal_time_us() + ACIO_BRINGUP_TIMEOUT_US;
+    while (!iccx_queue_loop_start(node_id, encrypted, deadline)) {
+        if (!acio_bringup_retry(deadline)) {
+            return false;
+        }
+    }
+
+    node->active = true;
     return true;
 }
 
-static bool iccx_set_state(
-    uint8_t node_id, int slot_state, icca_state_t *state)
+/* slot state commands are queued behind the poll and sent in the same burst */
+#define ICCX_SLOT_BATCH 4
+
+static struct ac_io_message iccx_slot_msg[ICCX_SLOT_BATCH];
+static struct acio_transaction iccx_slot_txn[ICCX_SLOT_BATCH];
+static uint8_t iccx_slot_count;
+
+static bool iccx_queue_set_state(uint8_t node_id, int slot_state)
 {
-    struct ac_io_message msg;
+    if (iccx_slot_count == ICCX_SLOT_BATCH) {
+        return false;
+    }
 
-    msg.addr = node_id + 1;
-    msg.cmd.code = ac_io_u16(AC_IO_CMD_ICCx_SET_SLOT_STATE);
-    msg.cmd.nbytes = 2;
+    struct ac_io_message *msg = &iccx_slot_msg[iccx_slot_count];
+    struct acio_transaction *txn = &iccx_slot_txn[iccx_slot_count];
+
+    msg->addr = node_id + 1;
+    msg->cmd.code = ac_io_u16(AC_IO_CMD_ICCx_SET_SLOT_STATE);
+    msg->cmd.nbytes = 2;
     /* buffer size of data we expect */
-    msg.cmd.raw[0] = sizeof(icca_state_t);
-    msg.cmd.raw[1] = slot_state;
+    msg->cmd.raw[0] = sizeof(icca_state_t);
+    msg->cmd.raw[1] = slot_state;
 
-    if (!acio_send_and_recv(
-            &msg, offsetof(struct ac_io_message, cmd.raw) + msg.cmd.raw[0])) {
+    /* the answer isn't used */
+    acio_transaction_init(txn, msg, 0, NULL, NULL);
+    if (!acio_submit(txn)) {
+        return false;
+    }
+
+    iccx_slot_count++;
+    iccx_nodes[node_id].slot_sent = slot_state;
+    return true;
+}
+
+/* wait for every queued slot state command, even if one already failed */
+static bool iccx_wait_set_state(uint8_t node_id)
+{
+    bool success = true;
+
+    for (uint8_t i = 0; i < iccx_slot_count; i++) {
+        if (!acio_wait(&iccx_slot_txn[i])) {
+            success = false;
+        }
+    }
+    iccx_slot_count = 0;
+
+    if (!success) {
+        /* don't know what the slot did, send it again next time */
+        iccx_nodes[node_id].slot_sent = ICCA_SLOT_STATE_UNKNOWN;
         #ifdef ICCX_DEBUG
         printf("Setting state of node ");
-        printf("{0}", node_id + 1);
+        printf("%d", node_id + 1);
         printf(" failed \n");
             #endif
-        return false;
     }
 
-    if (state != NULL) {
-        memcpy(state, msg.cmd.raw, sizeof(icca_state_t));
-    }
-
-    return true;
+    return success;
 }
 
-bool iccx_eject_card(icca_slot_state_t post_state)
+static bool iccx_queue_eject(uint8_t node_id, icca_slot_state_t post_state)
 {
-  if (!iccx_set_state(
-                0, AC_IO_ICCA_SLOT_STATE_EJECT, NULL)) {
+  if (!iccx_queue_set_state(node_id, AC_IO_ICCA_SLOT_STATE_EJECT)) {
             return false;
                 }
-       
-  if ((post_state != 0) && !iccx_set_state(0, post_state, NULL)) 
+
+  if ((post_state != 0) && !iccx_queue_set_state(node_id, post_state))
             {
             return false;
             }
             return true;
 }
 
-static bool iccx_get_state(uint8_t node_id, iccx_state_t *state, bool encrypted)
+bool iccx_eject_card(uint8_t node_id, icca_slot_state_t post_state)
 {
-    struct ac_io_message msg;
-    static icca_state_t icca_state;
+    if (node_id >= ICCX_MAX_NODES || !iccx_nodes[node_id].active) {
+        return false;
+    }
 
-    if (encrypted) 
-    {
-      sleep_ms(60); // wait a little before requesting the state when in encrypted mode (else ICCB fails)
+    bool queued = iccx_queue_eject(node_id, post_state);
+
+    iccx_nodes[node_id].slot_phase = ICCA_SLOT_EJECTING;
+    iccx_nodes[node_id].slot_phase_since_us = hal_time_us();
+
+    /* both commands go out back to back */
+    return iccx_wait_set_state(node_id) && queued;
+}
+
+static bool iccx_queue_slot_change(uint8_t node_id, icca_slot_state_t slot_state)
+{
+    if (iccx_nodes[node_id].slot_sent == slot_state) {
+        return true;
     }
-    
+    return iccx_queue_set_state(node_id, slot_state);
+}
+
+static enum icca_slot_phase icca_slot_sense(const icca_state_t *icca_state)
+{
+    bool front = icca_state->sensor_state & AC_IO_ICCA_SENSOR_MASK_FRONT_ON;
+    bool back = icca_state->sensor_state & AC_IO_ICCA_SENSOR_MASK_BACK_ON;
+
+    if (!front && !back) {
+        return ICCA_SLOT_EMPTY;
+    }
+    if (!front || !back) {
+        return ICCA_SLOT_INSERTING;
+    }
+    if (icca_state->status_code & AC_IO_ICCA_SENSOR_CARD) {
+        return ICCA_SLOT_LOCKED_VALID;
+    }
+    return ICCA_SLOT_LOCKED_INVALID;
+}
+
+/* decide the slot commands from the last poll, they don't depend on the
+   poll currently in flight */
+static bool iccx_queue_slot_state(uint8_t node_id)
+{
+    iccx_node_t *node = &iccx_nodes[node_id];
+    enum icca_slot_phase sensed = icca_slot_sense(&node->icca_state);
+    enum icca_slot_phase phase = node->slot_phase;
+    uint64_t now = hal_time_us();
+
+    /* an ejected card stays ejecting until the slot clears or it's
+       pushed back in, then it's judged again */
+    if (phase == ICCA_SLOT_EJECTING && sensed != ICCA_SLOT_EMPTY &&
+        (sensed == ICCA_SLOT_INSERTING || now - node->slot_phase_since_us < EJECT_DELAY * 1000ULL)) {
+        sensed = ICCA_SLOT_EJECTING;
+    }
+    if (sensed != phase) {
+        #ifdef ICCX_DEBUG
+        printf("slot phase %d -> %d\n", phase, sensed);
+        #endif
+        node->slot_phase = sensed;
+        node->slot_phase_since_us = now;
+    }
+
+#ifdef LOCK_ONLY_ISO15693
+    /* only a readable card goes in and gets locked, the shutter stays
+       closed otherwise */
+    if (sensed == ICCA_SLOT_INSERTING && (node->icca_state.status_code & AC_IO_ICCA_SENSOR_CARD)) {
+        return iccx_queue_slot_change(node_id, AC_IO_ICCA_SLOT_STATE_OPEN);
+    }
+    return iccx_queue_slot_change(node_id, AC_IO_ICCA_SLOT_STATE_CLOSE);
+#else
+    switch (sensed) {
+    case ICCA_SLOT_EMPTY:
+        /* the mechanism wants a close before opening again after an eject */
+        if (phase == ICCA_SLOT_EJECTING && !iccx_queue_set_state(node_id, AC_IO_ICCA_SLOT_STATE_CLOSE)) {
+            return false;
+        }
+        return iccx_queue_slot_change(node_id, AC_IO_ICCA_SLOT_STATE_OPEN);
+    case ICCA_SLOT_LOCKED_VALID:
+        return iccx_queue_slot_change(node_id, AC_IO_ICCA_SLOT_STATE_CLOSE);
+    case ICCA_SLOT_LOCKED_INVALID:
+        if (now - node->slot_phase_since_us < EJECT_DELAY * 1000ULL) {
+            return true;
+        }
+        #ifdef ICCX_DEBUG
+        printf("eject now!");
+        #endif
+        node->slot_phase = ICCA_SLOT_EJECTING;
+        node->slot_phase_since_us = now;
+        return iccx_queue_eject(node_id, AC_IO_ICCA_SLOT_STATE_CLOSE);
+    default:
+        /* leave the card alone while it moves */
+        return true;
+    }
+#endif
+}
+
+static bool iccx_get_state(uint8_t node_id, iccx_state_t *state)
+{
+    struct ac_io_message msg;
+    struct acio_transaction txn;
+    iccx_node_t *node = &iccx_nodes[node_id];
+    bool encrypted = node->profile.encrypted;
+
     msg.addr = node_id + 1;
     msg.cmd.code = ac_io_u16(encrypted? AC_IO_CMD_ICCx_FEL_POLL : AC_IO_CMD_ICCx_POLL);
     msg.cmd.nbytes = 1;
     /* buffer size of data we expect */
     msg.cmd.count = sizeof(iccx_state_t);
 
-    if (!acio_send_and_recv(
-            &msg, offsetof(struct ac_io_message, cmd.raw) + msg.cmd.count)) {
+    /* FEL_POLL adds the CRC */
+    acio_transaction_init(&txn, &msg, sizeof(iccx_state_t) + (encrypted ? 2 : 0), NULL, NULL);
+    if (!acio_submit(&txn)) {
+        return false;
+    }
+
+    bool slot_success = true;
+    if (node->profile.slot)
+    {
+        slot_success = iccx_queue_slot_state(node_id);
+    }
+
+    bool poll_success = acio_wait(&txn);
+
+    /* only an unanswered poll right after an ENGAGE says the wait was too short */
+    if (encrypted && node->pace_engaged && (poll_success || txn.error == ACIO_ERR_TIMEOUT)) {
+        iccx_pace_update(node, !poll_success);
+    }
+    node->pace_engaged = false;
+
+    if (node->profile.slot && !iccx_wait_set_state(node_id))
+    {
+        slot_success = false;
+    }
+
+    if (!poll_success) {
                       #ifdef ICCX_DEBUG
         printf("Getting state of node ");
         printf("%d", node_id + 1);
@@ -146,135 +603,82 @@ static bool iccx_get_state(uint8_t node_id, iccx_state_t *state, bool encrypted)
             #endif
         return false;
     }
+
+    if (!slot_success)
+    {
+        return false;
+    }
     
     if (encrypted)
-    /* got the encrypted data, decrypt it and check crc */
+    /* decrypt and check the crc in one pass, straight into the result */
     {
-      crypto.crypt(msg.cmd.raw,18);
+      iccx_state_t scratch;
+      iccx_state_t *plain = state != NULL ? state : &scratch;
+      uint16_t crc;
+      bool crc_ok = node->crypto.decryptChecked(msg.cmd.raw, (unsigned char *)plain, sizeof(iccx_state_t), &crc);
+
+      if (capture_is_enabled())
+      {
+        /* lets a capture be replayed without the session keys */
+        memcpy(msg.cmd.raw, plain, sizeof(iccx_state_t));
+        msg.cmd.raw[16] = crc >> 8;
+        msg.cmd.raw[17] = crc & 0xFF;
+        capture_frame(true, CAPTURE_DECRYPTED, (const uint8_t *)&msg, offsetof(struct ac_io_message, cmd.raw) + 18);
+      }
       #ifdef ICCX_DEBUG
       printf("DECRYPTED : ");
-      for (int i=0; i<18; i++)
+      for (int i=0; i<16; i++)
       {
-        if(msg.cmd.raw[i] < 0x10) printf("0");
-        printf("%X", msg.cmd.raw[i]);
+        if(((uint8_t *)plain)[i] < 0x10) printf("0");
+        printf("%X", ((uint8_t *)plain)[i]);
         printf(" ");
       }
-      printf("\n");
+      printf("%04X\n", crc);
       #endif
 
-      /* last two bytes are the CRC */
-      uint16_t crc = msg.cmd.raw[16] << 8 | msg.cmd.raw[17];
-      uint16_t crc_calc = crypto.CRCCCITT(msg.cmd.raw, 16);
-      if (crc != crc_calc) {
+      /* state is only the caller's scratch until this returns true */
+      if (!crc_ok) {
         #ifdef ICCX_DEBUG
         printf("INVALID CRC, received ");
         printf("%X", crc);
-        printf(" but calculated ");
-        printf("%X", crc_calc);
-        #endif        
-        return false;
-      }    
-    }
-    else
-    {
-#ifndef LOCK_ONLY_ISO15693
-        /* eject card if invalid */
-        static bool need_reset = false;      
-        static unsigned int eject_cooldown = 0;
-        if (eject_cooldown > 0) eject_cooldown--;
-        static unsigned long long eject_request_time = 0;
-        if (((icca_state.sensor_state & AC_IO_ICCA_SENSOR_MASK_BACK_ON) &&
-          (icca_state.sensor_state & AC_IO_ICCA_SENSOR_MASK_FRONT_ON) &&
-          (icca_state.status_code & AC_IO_ICCA_SENSOR_NO_CARD))) 
-        {
-          #ifdef ICCX_DEBUG
-          printf("bad card inside");
-          #endif
-            unsigned long long curr_time = to_ms_since_boot(get_absolute_time());
-            if ((eject_request_time != 0) && (curr_time - eject_request_time >= EJECT_DELAY))
-            {
-              #ifdef ICCX_DEBUG
-              printf("eject now!");
-              #endif
-              eject_cooldown = 20;
-              if (!iccx_eject_card(AC_IO_ICCA_SLOT_STATE_CLOSE))
-              {
-              return false;
-              }            
-              eject_request_time = 0;
-              need_reset = true;
-            }
-            else if ((eject_cooldown == 0) && (eject_request_time == 0))
-            {
-              #ifdef ICCX_DEBUG
-              printf("request eject!");
-              #endif
-              eject_request_time = curr_time;
-            }
+        #endif
+        if (node->crc_failures++ == 0) {
+          node->crc_failing_since_us = hal_time_us();
         }
-#endif
-
-#ifdef LOCK_ONLY_ISO15693  
-        /* allow new card to be inserted when currently inserting ISO15693 */
-        if (((icca_state.status_code & AC_IO_ICCA_SENSOR_CARD)) && (!(icca_state.sensor_state & AC_IO_ICCA_SENSOR_MASK_BACK_ON) ||
-            !(icca_state.sensor_state & AC_IO_ICCA_SENSOR_MASK_FRONT_ON)))
-#else
-        /* allow new card to be inserted when slot is clear */
-        if (((!(icca_state.sensor_state & AC_IO_ICCA_SENSOR_MASK_BACK_ON) &&
-            !(icca_state.sensor_state & AC_IO_ICCA_SENSOR_MASK_FRONT_ON))))
-#endif
-        {
+        node->stats.crc_errors++;
+        return false;
+      }
 
-#ifndef LOCK_ONLY_ISO15693
-        if (need_reset)
-          {
-            if (!iccx_set_state(node_id, AC_IO_ICCA_SLOT_STATE_CLOSE, NULL)) 
-            {
-            return false;
-            }
-            need_reset = false;
-          }
-#endif
-            if (!iccx_set_state(node_id, AC_IO_ICCA_SLOT_STATE_OPEN, NULL)) 
-            {
-            return false;
-            }
-        }
-#ifdef LOCK_ONLY_ISO15693  
-        else {
-            if (!iccx_set_state(node_id, AC_IO_ICCA_SLOT_STATE_CLOSE, NULL)) 
-            {
-            return false;
-            }
-        }
-#endif
-        /* lock the card when fully inserted */
-        if ((icca_state.sensor_state & AC_IO_ICCA_SENSOR_MASK_BACK_ON) &&
-          (icca_state.sensor_state & AC_IO_ICCA_SENSOR_MASK_FRONT_ON) &&
-          (icca_state.status_code & AC_IO_ICCA_SENSOR_CARD))
-        {
-          if (!iccx_set_state(
-                node_id, AC_IO_ICCA_SLOT_STATE_CLOSE, NULL)) 
-          {
-            return false;
-          }
+      if (node->crc_failures > 0) {
+        uint32_t recovery = (uint32_t)(hal_time_us() - node->crc_failing_since_us);
+        node->stats.last_recovery_us = recovery;
+        if (recovery > node->stats.max_recovery_us) {
+          node->stats.max_recovery_us = recovery;
         }
-    
-      
+        node->crc_failures = 0;
+      }
+
+      /* icca_state is only used by the plain slotted reader */
+      return true;
     }
 
     if (state != NULL) {
         memcpy(state, msg.cmd.raw, sizeof(iccx_state_t));
-        memcpy(&icca_state, msg.cmd.raw, sizeof(icca_state_t));
+        memcpy(&node->icca_state, msg.cmd.raw, sizeof(icca_state_t));
     }
 
     return true;
 }
 
-static bool iccx_read_card(uint8_t node_id, iccx_state_t *state, bool encrypted)
+/* a plain ENGAGE answers with the full state, which goes to state; a
+   FEL_ENGAGE answer has nothing we use */
+static bool iccx_read_card(uint8_t node_id, iccx_state_t *state)
 {
 
     struct ac_io_message msg;
+    struct acio_transaction txn;
+    iccx_node_t *node = &iccx_nodes[node_id];
+    bool encrypted = node->profile.encrypted;
 
     msg.addr = node_id + 1;
     if (encrypted)
@@ -291,9 +695,27 @@ static bool iccx_read_card(uint8_t node_id, iccx_state_t *state, bool encrypted)
       msg.cmd.nbytes = 1;
       msg.cmd.count = sizeof(iccx_state_t);
     }
-    
-    if (!acio_send_and_recv(
-            &msg, offsetof(struct ac_io_message, cmd.raw) + msg.cmd.count)) {
+
+    acio_transaction_init(&txn, &msg, encrypted ? 0 : sizeof(iccx_state_t), NULL, NULL);
+    if (!acio_submit(&txn)) {
+        return false;
+    }
+
+    /* the slot keeps up even when a cycle is just the ENGAGE */
+    bool slot_success = true;
+    if (node->profile.slot)
+    {
+        slot_success = iccx_queue_slot_state(node_id);
+    }
+
+    bool engaged = acio_wait(&txn);
+
+    if (node->profile.slot && !iccx_wait_set_state(node_id))
+    {
+        slot_success = false;
+    }
+
+    if (!engaged) {
               #ifdef ICCX_DEBUG
         printf("Reading card of node ");
         printf("%d", node_id + 1);
@@ -302,81 +724,431 @@ static bool iccx_read_card(uint8_t node_id, iccx_state_t *state, bool encrypted)
         return false;
     }
 
-    if (state != NULL) {
+    if (!slot_success)
+    {
+        return false;
+    }
+
+    if (!encrypted && state != NULL) {
         memcpy(state, msg.cmd.raw, sizeof(iccx_state_t));
+        memcpy(&node->icca_state, msg.cmd.raw, sizeof(icca_state_t));
     }
 
     return true;
 }
 
+/* whether the reader may have a card an ENGAGE would read */
+static bool iccx_card_possible(const iccx_node_t *node, const iccx_state_t *state)
+{
+  if (state->sensor_state != AC_IO_ICCx_SENSOR_NO_CARD)
+  {
+    return true;
+  }
+  /* a slotted reader says no card until it's fully in */
+  return node->profile.slot && (((const icca_state_t *)state)->sensor_state &
+                               (AC_IO_ICCA_SENSOR_MASK_FRONT_ON | AC_IO_ICCA_SENSOR_MASK_BACK_ON));
+}
 
-bool iccx_scan_card(uint8_t *type, uint8_t *uid, uint16_t *key_state, bool encrypted)
+/* the answer carries the UID of a card read by an earlier ENGAGE */
+static bool iccx_card_read(const iccx_state_t *state)
 {
+  static const uint8_t blank_uid[8] = {0};
+  return state->sensor_state == AC_IO_ICCx_SENSOR_CARD && memcmp(state->uid, blank_uid, 8) != 0;
+}
 
-  iccx_state_t state;
+static void iccx_push_key_edge(uint8_t node_id, uint16_t mask, bool pressed)
+{
+  if ((uint8_t)(iccx_key_edge_head - iccx_key_edge_tail) == ICCX_KEY_EDGE_QUEUE)
+  {
+    iccx_nodes[node_id].stats.key_edges_dropped++;
+    return;
+  }
 
+  iccx_key_edge_t *edge = &iccx_key_edges[iccx_key_edge_head & (ICCX_KEY_EDGE_QUEUE - 1)];
+  edge->node_id = node_id;
+  edge->pressed = pressed;
+  edge->mask = mask;
+  iccx_key_edge_head++;
+}
 
-//icca_read_card suivi de get_state
+bool iccx_pop_key_edge(iccx_key_edge_t *edge)
+{
+  if (iccx_key_edge_tail == iccx_key_edge_head)
+  {
+    return false;
+  }
+  *edge = iccx_key_edges[iccx_key_edge_tail & (ICCX_KEY_EDGE_QUEUE - 1)];
+  iccx_key_edge_tail++;
+  return true;
+}
 
-  #ifdef ICCX_DEBUG
-   printf("STEP1. CARD READ");
-  #endif
-  if (!iccx_read_card(0, &state, encrypted)){
-  #ifdef ICCX_DEBUG
-   printf("cmd read card failed");
-  #endif
-  return false;
- }
-  
-  #ifdef ICCX_DEBUG
-   printf("STEP2. GET STATE");
-  #endif
- if (!iccx_get_state(0, &state, encrypted)){
-  #ifdef ICCX_DEBUG
-   printf("cmd get state failed");
-  #endif
-  return false;
- }
+/* key_events numbers keys 1..C from bit 8 (key 0) on, wrapping to bit 0 */
+static uint16_t iccx_key_event_mask(uint8_t event)
+{
+  return 1 << (((event & 0x0F) + 7) & 0x0F);
+}
+
+/* key_state only shows what is down at poll time, a key tapped between
+   two polls never appears in it. key_events remembers the last two
+   presses, newest first, each tagged with a 4 bit sequence number, so
+   the presses since the last answer can be replayed in order, with the
+   releases key_state implies. */
+static void iccx_decode_keys(uint8_t node_id, const iccx_state_t *state)
+{
+  iccx_node_t *node = &iccx_nodes[node_id];
+  uint8_t newest = state->key_events[0];
+  uint16_t keys = node->key_edge_state;
+
+  if (!node->key_events_synced)
+  {
+    /* presses from before we started don't count */
+    node->key_events_synced = true;
+    node->key_event_last = newest;
+  }
+  else if ((newest & 0x0F) != 0 && newest != node->key_event_last)
+  {
+    /* an empty history counts as sequence -1, the first press is 0 */
+    uint8_t last_seq = (node->key_event_last & 0x0F) ? node->key_event_last >> 4 : 0x0F;
+    uint8_t count = ((newest >> 4) - last_seq) & 0x0F;
+
+    if (count == 0)
+    {
+      count = 1;
+    }
+    if (count > 2)
+    {
+      node->stats.key_events_lost += count - 2;
+      count = 2;
+    }
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+      uint8_t event = state->key_events[i];
+      if ((event & 0x0F) == 0)
+      {
+        continue;
+      }
+      uint16_t mask = iccx_key_event_mask(event);
+
+      /* pressed again, so it was let go in between */
+      if (keys & mask)
+      {
+        iccx_push_key_edge(node_id, mask, false);
+      }
+      iccx_push_key_edge(node_id, mask, true);
+      keys |= mask;
+
+      /* not down any more: let go before the next press */
+      if (!(state->key_state & mask))
+      {
+        iccx_push_key_edge(node_id, mask, false);
+        keys &= ~mask;
+      }
+    }
+    node->key_event_last = newest;
+  }
+
+  /* key_state settles the rest: releases, and keys down without an event */
+  uint16_t changed = keys ^ state->key_state;
+  for (int bit = 0; bit < 16; bit++)
+  {
+    uint16_t mask = 1 << bit;
+    if (changed & mask)
+    {
+      iccx_push_key_edge(node_id, mask, (state->key_state & mask) != 0);
+    }
+  }
+  node->key_edge_state = state->key_state;
+}
+
+void iccx_close()
+{
+  for (int i = 0; i < ICCX_MAX_NODES; i++)
+  {
+    iccx_node_t *node = &iccx_nodes[i];
+    if (!node->active)
+    {
+      continue;
+    }
+    for (int bit = 0; bit < 16; bit++)
+    {
+      if (node->key_edge_state & (1 << bit))
+      {
+        iccx_push_key_edge(i, 1 << bit, false);
+      }
+    }
+    node->key_edge_state = 0;
+    node->active = false;
+  }
+}
+
+/* turn a poll response into what the host cares about */
+static void iccx_decode_scan(uint8_t node_id, const iccx_state_t *state, iccx_scan_result_t *result)
+{
+  result->node_id = node_id;
 
 /* copy data into type and uid*/
  #ifdef ICCX_DEBUG
    printf("scan card success.");
-   if (state.sensor_state == 2){
-    if ((state.card_type&0x0F) == AC_IO_ICCx_CARD_TYPE_FELICA) printf("FeliCa ");
+   if (state->sensor_state == 2){
+    if ((state->card_type&0x0F) == AC_IO_ICCx_CARD_TYPE_FELICA) printf("FeliCa ");
     else printf("ISO15693 ");
     printf("card found!");
     printf("UID =");
     for (int i=0; i<8; i++)
     {
       printf(" ");
-      if (state.uid[i] < 0x10) printf("0");
-      printf("%X\n", state.uid[i]);
+      if (state->uid[i] < 0x10) printf("0");
+      printf("%X\n", state->uid[i]);
     }
     printf("\n");
     printf("card type = ");
-    printf("%d", state.card_type&0x0F);
+    printf("%d", state->card_type&0x0F);
    }
    else {
     printf("no card found (status = ");
-    printf("%d", state.sensor_state);
+    printf("%d", state->sensor_state);
     printf(")");
    }
   #endif
   
-  *key_state = state.key_state;
-  if (!encrypted)
+  result->key_state = state->key_state;
+  iccx_decode_keys(node_id, state);
+  if (!iccx_nodes[node_id].profile.encrypted)
   {
-    if (state.card_type != 0x30){
-      *type = 0;
-      return true;
+    if (state->card_type != 0x30){
+      result->type = 0;
+      return;
     }
   }
-  if (state.sensor_state == AC_IO_ICCx_SENSOR_CARD) {
-  memcpy(uid, state.uid, 8);
-  *type = (state.card_type&0x0F)+1;
+  /* a card that showed up after the last ENGAGE is seen by the sensor
+     but not read yet, its UID is still blank */
+  if (iccx_card_read(state)) {
+  memcpy(result->uid, state->uid, 8);
+  result->type = (state->card_type&0x0F)+1;
   }
-  else *type = 0;
-  
-  return true;
-  
-}
\ No newline at end of file
+  else result->type = 0;
+}
+
+static bool iccx_keypad_active(const iccx_node_t *node, uint64_t now)
+{
+  return now < node->keypad_active_until_us;
+}
+
+/* keys held or just changed keep the keypad lane open */
+static void iccx_keypad_update(iccx_node_t *node, uint16_t key_state, uint64_t now)
+{
+  if (key_state != 0 || key_state != node->key_state)
+  {
+    if (!iccx_keypad_active(node, now))
+    {
+      node->card_scan_due_us = now + ICCX_KEYPAD_CARD_SCAN_US;
+    }
+    node->keypad_active_until_us = now + ICCX_KEYPAD_ACTIVE_US;
+  }
+  node->key_state = key_state;
+}
+
+/* run one step of the scan cycle: ENGAGE then POLL, the ENGAGE is skipped
+   while the reader has no card and the POLL when a plain ENGAGE already
+   read one */
+static iccx_scan_status_t iccx_run_step(uint8_t node_id, iccx_scan_result_t *result)
+{
+  iccx_node_t *node = &iccx_nodes[node_id];
+  iccx_state_t state;
+
+  result->node_id = node_id;
+
+  if (node->step == ICCX_STEP_ENGAGE)
+  {
+  #ifdef ICCX_DEBUG
+   printf("STEP1. CARD READ");
+  #endif
+    if (!iccx_read_card(node_id, &state)){
+  #ifdef ICCX_DEBUG
+   printf("cmd read card failed");
+  #endif
+      node->due_us = hal_time_us();
+      return ICCX_SCAN_ERROR;
+    }
+
+    /* the plain ENGAGE answer already holds the UID, no need to poll */
+    if (!node->profile.encrypted)
+    {
+      iccx_decode_scan(node_id, &state, result);
+      if (result->type != 0)
+      {
+        node->due_us = hal_time_us();
+        iccx_keypad_update(node, state.key_state, node->due_us);
+        return ICCX_SCAN_DONE;
+      }
+    }
+
+    /* another node can use the bus while this one gets ready */
+    node->step = ICCX_STEP_POLL;
+    node->due_us = hal_time_us() + (node->profile.encrypted ? node->pace_gap_us : 0);
+    node->pace_engaged = node->profile.encrypted;
+    return ICCX_SCAN_BUSY;
+  }
+
+  #ifdef ICCX_DEBUG
+   printf("STEP2. GET STATE");
+  #endif
+  node->step = ICCX_STEP_ENGAGE;
+  bool polled = iccx_get_state(node_id, &state);
+  node->due_us = hal_time_us();
+
+  if (!polled){
+  #ifdef ICCX_DEBUG
+   printf("cmd get state failed");
+  #endif
+    /* the node still answers but we can't decrypt it any more: agree on
+       new keys with just that node, the bus and the others carry on */
+    if (node->crc_failures >= ICCX_RESYNC_CRC_FAILURES &&
+        node->crc_failures % ICCX_RESYNC_CRC_FAILURES == 0)
+    {
+      node->stats.resyncs++;
+      if (!iccx_key_exchange(node_id)) {
+        node->stats.resync_failures++;
+      }
+      node->due_us = hal_time_us();
+    }
+    return ICCX_SCAN_ERROR;
+  }
+
+  uint64_t now = hal_time_us();
+  bool engage = iccx_card_possible(node, &state);
+
+  /* while keys move, the card is only engaged every ICCX_KEYPAD_CARD_SCAN_US,
+     the cycles in between are polls for the keypad. A card already read
+     stays in the answers, so an encrypted reader holding one isn't
+     engaged at all. */
+  iccx_keypad_update(node, state.key_state, now);
+  if (engage && iccx_keypad_active(node, now))
+  {
+    if ((node->profile.encrypted && iccx_card_read(&state)) || now < node->card_scan_due_us)
+    {
+      engage = false;
+    }
+    else
+    {
+      node->card_scan_due_us = now + ICCX_KEYPAD_CARD_SCAN_US;
+    }
+  }
+
+  /* nothing on the reader (or keypad only), the next cycle is just the
+     poll. Without a card it waits as long as after an ENGAGE, to keep
+     the scan rate. The wait is the reader finishing the ENGAGE, so the
+     keypad lane polls again straight away and iccx_service() shares the
+     bus out. */
+  if (!engage)
+  {
+    node->step = ICCX_STEP_POLL;
+    node->due_us = now + ((node->profile.encrypted && !iccx_keypad_active(node, now)) ? node->pace_gap_us : 0);
+  }
+
+  iccx_decode_scan(node_id, &state, result);
+  return ICCX_SCAN_DONE;
+}
+
+void iccx_get_stats(uint8_t node_id, struct iccx_stats *stats)
+{
+  if (node_id >= ICCX_MAX_NODES) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  *stats = iccx_nodes[node_id].stats;
+}
+
+/* an encrypted reader's lane polls are always due, a lead on top would
+   keep the bus from the others */
+static uint64_t iccx_keypad_lead_us(const iccx_node_t *node, uint64_t now)
+{
+  return (!node->profile.encrypted && iccx_keypad_active(node, now)) ? ICCX_KEYPAD_LEAD_US : 0;
+}
+
+iccx_scan_status_t iccx_service(iccx_scan_result_t *result)
+{
+  uint64_t now = hal_time_us();
+  int next = -1;
+
+  /* the node that has been due the longest, an active keypad counting as
+     due ICCX_KEYPAD_LEAD_US earlier */
+  for (int i = 0; i < ICCX_MAX_NODES; i++)
+  {
+    iccx_node_t *node = &iccx_nodes[i];
+
+    if (!node->active || node->due_us > now)
+    {
+      continue;
+    }
+
+    if (next < 0)
+    {
+      next = i;
+      continue;
+    }
+
+    uint64_t lead = iccx_keypad_lead_us(node, now);
+    uint64_t next_lead = iccx_keypad_lead_us(&iccx_nodes[next], now);
+    if (node->due_us + next_lead < iccx_nodes[next].due_us + lead)
+    {
+      next = i;
+    }
+  }
+
+  if (next < 0)
+  {
+    /* nothing due: get the keystream for the next answers ready now,
+       so decrypting one is only the xor */
+    for (int i = 0; i < ICCX_MAX_NODES; i++)
+    {
+      if (iccx_nodes[i].active && iccx_nodes[i].profile.encrypted)
+      {
+        iccx_nodes[i].crypto.refill();
+      }
+    }
+    return ICCX_SCAN_IDLE;
+  }
+
+  return iccx_run_step(next, result);
+}
+
+bool iccx_scan_card(uint8_t node_id, uint8_t *type, uint8_t *uid, uint16_t *key_state)
+{
+  iccx_scan_result_t result;
+
+  if (node_id >= ICCX_MAX_NODES || !iccx_nodes[node_id].active)
+  {
+    return false;
+  }
+
+  iccx_node_t *node = &iccx_nodes[node_id];
+
+  while (true)
+  {
+    uint64_t now = hal_time_us();
+    if (node->due_us > now)
+    {
+      hal_sleep_us(node->due_us - now);
+    }
+
+    switch (iccx_run_step(node_id, &result))
+    {
+    case ICCX_SCAN_DONE:
+      *type = result.type;
+      *key_state = result.key_state;
+      if (result.type)
+      {
+        memcpy(uid, result.uid, 8);
+      }
+      return true;
+
+    case ICCX_SCAN_ERROR:
+      return false;
+
+    default:
+      break;
+    }
+  }
+}
@@ -0,0 +1,114 @@
+#include "Link.h"
+#include "ACIO.h"
+#include "HAL.h"
+#include <string.h>
+
+static bool link_up;
+static bool link_lost;        /* down after having been up, for the recovery time */
+static uint64_t link_lost_us;
+static uint64_t link_retry_us; /* next bring-up attempt */
+static uint32_t link_backoff_us;
+static uint8_t link_node_errors[ICCX_MAX_NODES];
+static struct link_stats link_stats;
+
+void link_init()
+{
+    link_up = false;
+    link_lost = false;
+    link_retry_us = 0;
+    link_backoff_us = LINK_RETRY_MIN_US;
+    memset(link_node_errors, 0, sizeof(link_node_errors));
+    memset(&link_stats, 0, sizeof(link_stats));
+}
+
+/* enumerate the bus, then every reader with the profile of its model */
+static bool link_bringup()
+{
+    if (!acio_open())
+    {
+        return false;
+    }
+    for (uint8_t i = 0; i < acio_get_node_count() && i < ICCX_MAX_NODES; i++)
+    {
+        if (!iccx_init(i, NULL))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool link_service()
+{
+    if (link_up)
+    {
+        return true;
+    }
+    if (hal_time_us() < link_retry_us)
+    {
+        return false;
+    }
+
+    link_stats.attempts++;
+    /* nothing from a previous session may keep polling */
+    iccx_close();
+    if (!link_bringup())
+    {
+        iccx_close();
+        link_stats.failures++;
+        link_retry_us = hal_time_us() + link_backoff_us;
+        link_backoff_us = link_backoff_us * 2 > LINK_RETRY_MAX_US ? LINK_RETRY_MAX_US : link_backoff_us * 2;
+        return false;
+    }
+
+    if (link_lost)
+    {
+        uint32_t recovery = (uint32_t)(hal_time_us() - link_lost_us);
+        link_stats.last_recovery_us = recovery;
+        if (recovery > link_stats.max_recovery_us)
+        {
+            link_stats.max_recovery_us = recovery;
+        }
+        link_lost = false;
+    }
+    memset(link_node_errors, 0, sizeof(link_node_errors));
+    link_backoff_us = LINK_RETRY_MIN_US;
+    link_up = true;
+    return true;
+}
+
+bool link_is_up()
+{
+    return link_up;
+}
+
+void link_report(iccx_scan_status_t status, uint8_t node_id)
+{
+    if (!link_up || node_id >= ICCX_MAX_NODES || status == ICCX_SCAN_IDLE)
+    {
+        return;
+    }
+    if (status != ICCX_SCAN_ERROR)
+    {
+        link_node_errors[node_id] = 0;
+        return;
+    }
+    if (++link_node_errors[node_id] < LINK_LOSS_ERRORS)
+    {
+        return;
+    }
+
+    /* the reader most likely lost its address too, start over with the
+       whole bus right away */
+    iccx_close();
+    link_up = false;
+    link_lost = true;
+    link_lost_us = hal_time_us();
+    link_retry_us = link_lost_us;
+    link_stats.losses++;
+}
+
+void link_get_stats(struct link_stats *stats)
+{
+    *stats = link_stats;
+}
@@ -3,13 +3,15 @@
 #include "pico/stdio.h"
 #include "bsp/board.h"
 
-#include "hardware/uart.h"
-
 #include "tusb.h"
 #include "usb_descriptors.h"
 
+#include "HAL.h"
 #include "ACIO.h"
 #include "ICCx.h"
+#include "Capture.h"
+#include "CardCache.h"
+#include "Link.h"
 
 #define WITH_USBHID
 
@@ -21,38 +23,62 @@
 #define KEYPAD_NKRO_MAP "\x59\x5a\x5b\x5c\x5d\x5e\x5f\x60\x61\x62\x56\x63"
 
 #ifdef WITH_USBHID
-#define USB_HID_COOLDOWN 3000
+#define USB_HID_COOLDOWN 3000 // the same card isn't reported again if it comes back this soon (in ms)
 #define cardio
 #endif
 
 /* ICCA-only (slotted) options */
 #define PIN_EJECT_BUTTON 8
 #define KEYPAD_BLANK_EJECT 1 // make blank key from keypad eject currently inserted card (ICCA only)
-#define AUTO_EJECT_TIMER 0   // auto eject valid cards after a set delay (in ms), 0 to disable (note: must be smaller than USB_HID_COOLDOWN)
+#define AUTO_EJECT_TIMER 0   // auto eject valid cards after a set delay (in ms), 0 to disable
 
 // #define PRESS_KEY_ON_BOOT //press a key on boot (useful for some motherboards)
 #define PRESS_KEY_TIMER 5000
 #define PRESS_KEY_DURATION 500
 #define PRESS_KEY KEY_F1
 
+/* CDC instance of the "WAVEPASS Pico EAMUSE Port", streams the ACIO capture */
+#define CAPTURE_CDC_PORT 1
+
 bool g_passthrough = false; // native mode (use pico as simple TTL to USB)
-bool g_encrypted = true;    // FeliCa support and new readers (set to false for ICCA support, set to true otherwise)
+// encrypted polling (FeliCa) and the ICCA slot are picked per reader from its product code
 
+/* in KEYPAD_NKRO_MAP order, 00 is - and the blank key is . */
 static int g_keypad_mask[12] = 
-{ICCx_KEYPAD_MASK_0, ICCx_KEYPAD_MASK_00, ICCx_KEYPAD_MASK_EMPTY, 
- ICCx_KEYPAD_MASK_1, ICCx_KEYPAD_MASK_2, ICCx_KEYPAD_MASK_3, 
+{ICCx_KEYPAD_MASK_1, ICCx_KEYPAD_MASK_2, ICCx_KEYPAD_MASK_3, 
  ICCx_KEYPAD_MASK_4, ICCx_KEYPAD_MASK_5, ICCx_KEYPAD_MASK_6, 
- ICCx_KEYPAD_MASK_7, ICCx_KEYPAD_MASK_8, ICCx_KEYPAD_MASK_9};
+ ICCx_KEYPAD_MASK_7, ICCx_KEYPAD_MASK_8, ICCx_KEYPAD_MASK_9,
+ ICCx_KEYPAD_MASK_0, ICCx_KEYPAD_MASK_00, ICCx_KEYPAD_MASK_EMPTY};
+
+/* keys down per reader, as told by the ICCx key edges */
+static uint16_t node_keys[ICCX_MAX_NODES];
 
-static bool keypad_vals[12];
+/* cards waiting for a cardio report, power of two. Cards on several
+   readers at once each get theirs, one per report. */
+#define HID_CARDIO_QUEUE 4
 
 static struct
 {
-    uint8_t current[9];
-    uint8_t reported[9];
-    uint64_t report_time;
+    uint8_t reports[HID_CARDIO_QUEUE][9];
+    uint8_t head;
+    uint8_t tail;
 } hid_cardio;
 
+/* the oldest waiting report goes if the queue is full, the host would
+   rather have the latest card */
+static void queue_hid_cardio(uint8_t type, const uint8_t *uid)
+{
+    if ((uint8_t)(hid_cardio.head - hid_cardio.tail) == HID_CARDIO_QUEUE)
+    {
+        hid_cardio.tail++;
+    }
+
+    uint8_t *report = hid_cardio.reports[hid_cardio.head & (HID_CARDIO_QUEUE - 1)];
+    report[0] = type;
+    memcpy(report + 1, uid, 8);
+    hid_cardio.head++;
+}
+
 void passthrough_loop()
 {
     while (1)
@@ -66,7 +92,7 @@ void passthrough_loop()
                 uint32_t count = tud_cdc_read(buf, sizeof(buf));
                 for (uint32_t i = 0; i < count; i++)
                 {
-                    uart_putc(uart1, buf[i]);
+                    hal_uart_putc(buf[i]);
                 }
             }
             if (tud_cdc_write_flush())
@@ -75,29 +101,49 @@ void passthrough_loop()
                 uint32_t count = tud_cdc_read(buf, sizeof(buf));
                 for (uint32_t i = 0; i < count; i++)
                 {
-                    uart_putc(uart1, buf[i]);
+                    hal_uart_putc(buf[i]);
                 }
             }
         }
     }
 }
 
-void report_hid_cardio()
+/* forward captured ACIO frames as fast as the host takes them */
+void stream_capture()
 {
-    if (!tud_hid_ready())
+    if (!capture_is_enabled() || !tud_cdc_n_connected(CAPTURE_CDC_PORT))
     {
         return;
     }
 
-    uint64_t now = time_us_64();
+    uint8_t buf[64];
+    uint32_t space = tud_cdc_n_write_available(CAPTURE_CDC_PORT);
+    if (space > sizeof(buf))
+    {
+        space = sizeof(buf);
+    }
 
-    if ((memcmp(hid_cardio.current, hid_cardio.reported, 9) != 0) &&
-        (now - hid_cardio.report_time > 1000000))
+    int count = capture_read(buf, space);
+    if (count > 0)
     {
+        tud_cdc_n_write(CAPTURE_CDC_PORT, buf, count);
+        tud_cdc_n_write_flush(CAPTURE_CDC_PORT);
+    }
+}
+
+void report_hid_cardio()
+{
+    if (!tud_hid_ready())
+    {
+        return;
+    }
 
-        tud_hid_n_report(0x00, hid_cardio.current[0], hid_cardio.current + 1, 8);
-        memcpy(hid_cardio.reported, hid_cardio.current, 9);
-        hid_cardio.report_time = now;
+    /* the card cache already decided these cards are worth a report */
+    if (hid_cardio.head != hid_cardio.tail)
+    {
+        const uint8_t *report = hid_cardio.reports[hid_cardio.tail & (HID_CARDIO_QUEUE - 1)];
+        tud_hid_n_report(0x00, report[0], report + 1, 8);
+        hid_cardio.tail++;
     }
 }
 
@@ -108,25 +154,32 @@ struct __attribute__((packed)) {
 
 static const char keymap[13] = KEYPAD_NKRO_MAP;
 
+/* one key edge per report, so a key tapped between two polls still
+   reaches the host as a press and a release */
 void report_hid_key()
 {
-    if (!tud_hid_ready()) {
+    iccx_key_edge_t edge;
+
+    if (!tud_hid_n_ready(1) || !iccx_pop_key_edge(&edge)) {
         return;
     }
 
-    uint16_t keys = 0;
+    if (edge.pressed) {
+        node_keys[edge.node_id] |= edge.mask;
+    } else {
+        node_keys[edge.node_id] &= ~edge.mask;
+    }
 
-    for (int i = 0; i < 12; i++) {
-        if (keypad_vals[i]) {
-            keys |= (1 << i);
-        }
+    uint16_t keystate = 0;
+    for (int i = 0; i < ICCX_MAX_NODES; i++) {
+        keystate |= node_keys[i];
     }
 
-    for (int i = 0; i < 1; i++) {
+    for (int i = 0; i < 12; i++) {
         uint8_t code = keymap[i];
         uint8_t byte = code / 8;
         uint8_t bit = code % 8;
-        if (keys & (1 << i)) {
+        if (keystate & g_keypad_mask[i]) {
             hid_nkro.keymap[byte] |= (1 << bit);
         } else {
             hid_nkro.keymap[byte] &= ~(1 << bit);
@@ -135,6 +188,15 @@ void report_hid_key()
     tud_hid_n_report(1, 0, &hid_nkro, sizeof(hid_nkro));
 }
 
+/* everything the USB host waits on, also run while a reader bring-up blocks */
+void service_usb()
+{
+    tud_task();
+    stream_capture();
+    report_hid_cardio();
+    report_hid_key();
+}
+
 int main(void)
 {
     sleep_ms(50);
@@ -144,27 +206,16 @@ int main(void)
     tusb_init();
     stdio_init_all();
 
-    gpio_init(PIN_EJECT_BUTTON);
-    gpio_pull_up(PIN_EJECT_BUTTON);
-
-    uart_init(uart1, 57600);
-    gpio_set_function(6, GPIO_FUNC_UART);
-    gpio_set_function(7, GPIO_FUNC_UART);
-    uart_set_hw_flow(uart1, false, false);
-    uart_set_format(uart1, 8, 1, UART_PARITY_NONE);
-    uart_set_fifo_enabled(uart1, false);
-
-    // Enable the UART
-    uart_set_irq_enables(uart1, true, false);
+    hal_gpio_init_pullup(PIN_EJECT_BUTTON);
 
-    bool opened = acio_open();
+    // Enable the UART, RX is IRQ driven into a ring buffer
+    hal_uart_init(ACIO_DEFAULT_BAUDRATE);
 
-    sleep_ms(500);
-
-    if (opened)
-    {
-        iccx_init(0, g_encrypted);
-    }
+    card_cache_init(USB_HID_COOLDOWN * 1000);
+    /* the readers are brought up from the loop, and again whenever they
+       stop answering */
+    link_init();
+    hal_set_idle_hook(service_usb);
 
     while (1)
     {
@@ -173,79 +224,125 @@ int main(void)
             passthrough_loop();
             return 0;
         }
-        tud_task();
-
-        static unsigned long lastReport = 0;
-
-        uint8_t uid[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-        uint8_t type = 0;
-        uint16_t keystate = 0;
-        static uint16_t prev_keystate = 0;
+        service_usb();
 
-        if (!g_encrypted && gpio_get(PIN_EJECT_BUTTON) == 0)
+        bool was_up = link_is_up();
+        if (!link_service())
         {
-            iccx_eject_card(AC_IO_ICCA_SLOT_STATE_OPEN);
+            continue;
         }
-
-#if AUTO_EJECT_TIMER > 0
-        static bool already_eject = false;
-        if (!g_encrypted && !already_eject && ((to_ms_since_boot(get_absolute_time()) - lastReport) >= AUTO_EJECT_TIMER))
+#ifdef DEBUG
+        if (!was_up)
         {
-            iccx_eject_card(AC_IO_ICCA_SLOT_STATE_OPEN);
-            already_eject = true;
+            printf("ACIO link up at %lu baud, %d nodes\n",
+                   (unsigned long)acio_get_baudrate(), acio_get_node_count());
+            for (uint8_t i = 0; i < acio_get_node_count(); i++)
+            {
+                const iccx_profile_t *profile = iccx_get_profile(i);
+                printf("Reader %d: %.4s as %.4s, %s%s\n", i, acio_get_node_product(i), profile->product,
+                       profile->encrypted ? "encrypted" : "plain", profile->slot ? ", slot" : "");
+            }
         }
 #endif
 
-        if (!iccx_scan_card(&type, uid, &keystate, g_encrypted))
+#if AUTO_EJECT_TIMER > 0
+        static unsigned long lastReport = 0; // last card inserted, in ms
+#endif
+
+        /* polls are interleaved over every reader on the bus */
+        iccx_scan_result_t scan;
+        iccx_scan_status_t status = iccx_service(&scan);
+        link_report(status, scan.node_id);
+
+        if (status == ICCX_SCAN_ERROR)
         {
 #ifdef DEBUG
-            printf("Error communicating with wavepass reader.");
+            struct hal_uart_stats stats;
+            hal_uart_get_stats(&stats);
+            printf("Error communicating with wavepass reader %d. (error %d, rx %lu, dropped %lu, overruns %lu)\n",
+                   scan.node_id, acio_get_last_error(),
+                   (unsigned long)stats.rx_bytes, (unsigned long)stats.rx_dropped,
+                   (unsigned long)stats.rx_overruns);
+            if (!link_is_up())
+            {
+                printf("Readers lost, reconnecting\n");
+            }
 #endif
         }
-#ifdef KEYPAD_BLANK_EJECT
-        if (!g_encrypted && (keystate & ICCx_KEYPAD_MASK_EMPTY))
+
+        if (status == ICCX_SCAN_DONE)
         {
-            iccx_eject_card(AC_IO_ICCA_SLOT_STATE_OPEN);
-        }
+#ifdef DEBUG
+            static bool first_poll = true;
+            if (first_poll)
+            {
+                /* hal_time_us() counts from reset */
+                printf("Boot to first poll: %lu ms\n", (unsigned long)(hal_time_us() / 1000));
+                first_poll = false;
+            }
 #endif
+            uint8_t *uid = scan.uid;
+            uint8_t type = scan.type;
+            bool slot = iccx_get_profile(scan.node_id)->slot;
+            enum card_cache_event card = card_cache_update(scan.node_id, type, uid, hal_time_us());
 
-        for (int i = 0; i < 12; i++)
-        {
-            //check_key(i, keystate, prev_keystate);
-        }
-        prev_keystate = keystate;
+            if (slot && hal_gpio_get(PIN_EJECT_BUTTON) == 0)
+            {
+                iccx_eject_card(scan.node_id, AC_IO_ICCA_SLOT_STATE_OPEN);
+            }
 
-        if (type)
-        {
-#ifdef DEBUG
-            printf("Found a card of type ");
-            if (type == 1)
-                printf("ISO15693");
-            else
-                printf("FeliCa");
-            printf(" with uid =");
-            for (int i = 0; i < 8; i++)
+#if AUTO_EJECT_TIMER > 0
+            static bool already_eject = false;
+            if (slot && !already_eject && ((hal_time_us() / 1000 - lastReport) >= AUTO_EJECT_TIMER))
+            {
+                iccx_eject_card(scan.node_id, AC_IO_ICCA_SLOT_STATE_OPEN);
+                already_eject = true;
+            }
+#endif
+
+#ifdef KEYPAD_BLANK_EJECT
+            if (slot && (scan.key_state & ICCx_KEYPAD_MASK_EMPTY))
             {
-                printf(" ");
-                if (uid[i] < 0x10)
-                    printf("0");
-                printf("%X", uid[i]);
+                iccx_eject_card(scan.node_id, AC_IO_ICCA_SLOT_STATE_OPEN);
             }
-            printf("\n");
 #endif
 
-            if (to_ms_since_boot(get_absolute_time()) - lastReport < USB_HID_COOLDOWN)
-                continue;
+            if (card == CARD_CACHE_INSERTED)
+            {
+#ifdef DEBUG
+                printf("Found a card of type ");
+                if (type == 1)
+                    printf("ISO15693");
+                else
+                    printf("FeliCa");
+                printf(" with uid =");
+                for (int i = 0; i < 8; i++)
+                {
+                    printf(" ");
+                    if (uid[i] < 0x10)
+                        printf("0");
+                    printf("%X", uid[i]);
+                }
+                printf("\n");
+#endif
 
-            if (type == 1)
+#if AUTO_EJECT_TIMER > 0
+                lastReport = hal_time_us() / 1000;
+                already_eject = false;
+#endif
+
+                if (type == 1)
+                {
+                    queue_hid_cardio(0x01, uid);
+                }
+            }
+#ifdef DEBUG
+            else if (card == CARD_CACHE_REMOVED)
             {
-                hid_cardio.current[0] = 0x01;
-                memcpy(hid_cardio.current + 1, uid, 8);
+                printf("Card removed from reader %d\n", scan.node_id);
             }
+#endif
         }
-
-        report_hid_cardio();
-        report_hid_key();
     }
     return 0;
 }
@@ -273,22 +370,9 @@ void tud_hid_set_report_cb(uint8_t itf, uint8_t report_id,
 void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
 {
     printf("\nCDC Line State: %d %d", dtr, rts);
+    /* recording only runs while a terminal holds the capture port open */
+    if (itf == CAPTURE_CDC_PORT)
+    {
+        capture_set_enabled(dtr);
+    }
 }
-
-#define IS_PRESSED(x) ((keystate&x)&&(!(prev_keystate&x)))
-#define IS_RELEASED(x) ((!(keystate&x))&&(prev_keystate&x))
-static void check_key(uint8_t i, int keystate, int prev_keystate)
-{
-
- if (IS_PRESSED(g_keypad_mask[i]))
- {
-#ifdef WITH_USBHID
-    keypad_vals[i] = true;
- }
- else if (IS_RELEASED(g_keypad_mask[i]))
- { 
-    keypad_vals[i] = false;
-#endif  
- }
-
-}
\ No newline at end of file